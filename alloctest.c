@@ -0,0 +1,208 @@
+/*
+ * Counts the heap allocations snot makes once warmed up. snot.c is built
+ * with its main() renamed to snot_main() and runs as usual on the main
+ * thread; a second thread feeds it notifications, in rounds of one full
+ * stack over the local socket and one over D-Bus, each left to render and
+ * expire.
+ *
+ * The link wraps malloc, calloc, realloc and strdup, which redirects the
+ * calls made from snot's own objects only: the libraries it calls into
+ * keep using the real ones and are not counted.
+ *
+ * usage: alloctest [rounds]
+ * Needs a Wayland compositor with layer-shell and a session bus; make
+ * alloc-test provides both, see headless.sh.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dbus/dbus.h>
+#include "sockproto.h"
+#include "config.h"
+
+#define WARMUP 2            /* rounds before counting starts */
+#define EXPIRE 50           /* ms each notification is shown */
+#define SETTLE (BURST_WINDOW_LOW + FADE_TIME + 300) /* ms per round */
+
+int snot_main(void);
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+static unsigned long allocs;
+static int rounds = 10;
+
+void *
+__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+char *
+__wrap_strdup(const char *s) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_strdup(s);
+}
+
+static void
+die(const char *msg) {
+    fprintf(stderr, "alloctest: %s\n", msg);
+    exit(2);
+}
+
+static void
+sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+/* waits for snot to get as far as listening */
+static int
+connect_snot(void) {
+    struct sockaddr_un addr;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+             dir ? dir : ".", SOCKET_NAME);
+    for (int tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        if (fd >= 0)
+            close(fd);
+        sleep_ms(10);
+    }
+    die("snot is not listening");
+    return -1;
+}
+
+/*
+ * One stack's worth of notifications, each from its own app and with its
+ * own body so neither rate limiting nor dedup folds them.
+ */
+static void
+send_round(int fd, int round) {
+    static char buf[SOCK_PACKET_MAX];
+    char app[32], body[32];
+    SockNotify n = { app, "", "alloctest", body, 0, EXPIRE, 1 };
+
+    for (int i = 0; i < MAX_NOTIFICATIONS; i++) {
+        SockHeader hdr = { SOCK_MAGIC, 1 };
+        size_t len;
+
+        snprintf(app, sizeof(app), "alloctest-%d", round * MAX_NOTIFICATIONS + i);
+        snprintf(body, sizeof(body), "notification %d of round %d", i, round);
+        if (!(len = sock_pack(buf, sizeof(buf), sizeof(hdr), &n)))
+            die("notification too large");
+        memcpy(buf, &hdr, sizeof(hdr));
+        if (send(fd, buf, len, 0) < 0 || recv(fd, buf, sizeof(buf), 0) <= 0)
+            die("lost the local socket");
+    }
+    sleep_ms(SETTLE);
+}
+
+/* the same over the session bus, which takes the Notify path */
+static void
+bus_round(DBusConnection *conn, int round) {
+    for (int i = 0; i < MAX_NOTIFICATIONS; i++) {
+        DBusMessageIter it, sub;
+        const char *icon = "", *summary = "alloctest";
+        char app[32], body[32], *a = app, *b = body;
+        uint32_t replaces = 0;
+        int32_t timeout = EXPIRE;
+
+        DBusMessage *msg = dbus_message_new_method_call(
+            "org.freedesktop.Notifications", "/org/freedesktop/Notifications",
+            "org.freedesktop.Notifications", "Notify");
+        if (!msg)
+            die("out of memory");
+        snprintf(app, sizeof(app), "alloctest-bus-%d", round * MAX_NOTIFICATIONS + i);
+        snprintf(body, sizeof(body), "notification %d of round %d", i, round);
+        dbus_message_iter_init_append(msg, &it);
+        dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &a);
+        dbus_message_iter_append_basic(&it, DBUS_TYPE_UINT32, &replaces);
+        dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &icon);
+        dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &summary);
+        dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &b);
+        dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "s", &sub);
+        dbus_message_iter_close_container(&it, &sub);
+        dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "{sv}", &sub);
+        dbus_message_iter_close_container(&it, &sub);
+        dbus_message_iter_append_basic(&it, DBUS_TYPE_INT32, &timeout);
+
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(conn, msg,
+                                                                       1000, NULL);
+        dbus_message_unref(msg);
+        if (!reply)
+            die("Notify failed");
+        dbus_message_unref(reply);
+    }
+    sleep_ms(SETTLE);
+}
+
+static void *
+drive(void *arg) {
+    int fd = connect_snot();
+    unsigned long before, after;
+    DBusConnection *conn;
+
+    /* a connection of our own, snot's is used from the other thread */
+    dbus_threads_init_default();
+    if (!(conn = dbus_bus_get_private(DBUS_BUS_SESSION, NULL)))
+        die("no session bus");
+
+    for (int r = 0; r < WARMUP; r++) {
+        send_round(fd, r);
+        bus_round(conn, r);
+    }
+
+    before = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+    for (int r = 0; r < rounds; r++) {
+        send_round(fd, WARMUP + r);
+        bus_round(conn, WARMUP + r);
+    }
+    after = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+
+    printf("alloctest: %d notifications, %lu allocations after warm-up\n",
+           2 * rounds * MAX_NOTIFICATIONS, after - before);
+    dbus_connection_close(conn);
+    dbus_connection_unref(conn);
+    close(fd);
+    exit(after == before ? 0 : 1);
+    return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+    pthread_t driver;
+
+    if (argc > 1 && (rounds = atoi(argv[1])) <= 0)
+        die("rounds must be positive");
+    if (pthread_create(&driver, NULL, drive, NULL) != 0)
+        die("cannot start the driver thread");
+
+    snot_main();
+    die("snot exited");
+    return 2;
+}
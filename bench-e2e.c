@@ -0,0 +1,394 @@
+/*
+ * End to end benchmark: starts a fresh snot for each scenario, loads it
+ * over D-Bus and prints one JSON object with, per scenario, the Notify
+ * round trip percentiles, the rate reached, time from Notify to first
+ * commit (from org.snot.Stats), and snot's CPU time and peak RSS. Run it
+ * under headless.sh, as make bench does, for a private bus and compositor.
+ *
+ * usage: bench-e2e [-r rate] [-d seconds] path/to/snot
+ * -r and -d set the rate and length of the steady scenario (100/s, 3 s).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dbus/dbus.h>
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+#define DEST "org.freedesktop.Notifications"
+#define PATH "/org/freedesktop/Notifications"
+#define WINDOW 128          /* calls in flight at most */
+#define SETTLE 1000         /* ms left for rendering before reading stats */
+#define MAX_SAMPLES 262144
+#define MAX_STATS 128
+#define LARGE_BODY 4096
+#define SATURATED_RTT 0.1   /* s at p99 past which a rate is not kept up */
+
+typedef struct {
+    const char *name;
+    int count;              /* notifications, 0 to ramp until saturation */
+    double rate;            /* per second, 0 for as fast as the window allows */
+    int body;               /* body length, 0 for a short one */
+    int replace;            /* all replace the first */
+    int urgency;            /* cycle low, normal, critical */
+} Scenario;
+
+static DBusConnection *conn;
+static double samples[MAX_SAMPLES];
+static int sample_count;
+static int inflight, errors;
+static uint32_t replaces_id;
+static char *large_body;
+
+static struct {
+    char name[32];
+    double value;
+} stats[MAX_STATS];
+static int stat_count;
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *msg) {
+    fprintf(stderr, "bench-e2e: %s\n", msg);
+    exit(1);
+}
+
+static void
+sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* samples must be sorted */
+static double
+percentile(const double *s, int n, double p) {
+    if (!n)
+        return 0;
+    int i = p * n;
+    return s[i < n ? i : n - 1];
+}
+
+static DBusMessage *
+build_notify(const Scenario *sc, int i) {
+    DBusMessageIter it, sub, entry, variant;
+    DBusMessage *msg = dbus_message_new_method_call(DEST, PATH,
+                           "org.freedesktop.Notifications", "Notify");
+    char app[48], text[48], *body = text;
+    const char *icon = "", *summary = sc->name, *key = "urgency";
+    uint32_t replaces = sc->replace ? replaces_id : 0;
+    int32_t timeout = 1000;
+    uint8_t urgency = i % 3;
+
+    if (!msg)
+        die("out of memory");
+    /* an app and a body of its own, or rate limiting and dedup fold them */
+    snprintf(app, sizeof(app), "bench-%s-%d", sc->name, i);
+    snprintf(text, sizeof(text), "notification %d", i);
+    if (sc->body) {
+        memcpy(large_body, text, strlen(text));
+        body = large_body;
+    }
+    const char *a = app;
+
+    dbus_message_iter_init_append(msg, &it);
+    dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &a);
+    dbus_message_iter_append_basic(&it, DBUS_TYPE_UINT32, &replaces);
+    dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &icon);
+    dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &summary);
+    dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &body);
+    dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "s", &sub);
+    dbus_message_iter_close_container(&it, &sub);
+    dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "{sv}", &sub);
+    if (sc->urgency) {
+        dbus_message_iter_open_container(&sub, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+        dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "y", &variant);
+        dbus_message_iter_append_basic(&variant, DBUS_TYPE_BYTE, &urgency);
+        dbus_message_iter_close_container(&entry, &variant);
+        dbus_message_iter_close_container(&sub, &entry);
+    }
+    dbus_message_iter_close_container(&it, &sub);
+    dbus_message_iter_append_basic(&it, DBUS_TYPE_INT32, &timeout);
+    return msg;
+}
+
+static void
+notify_done(DBusPendingCall *pending, void *data) {
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+
+    if (!reply || dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        errors++;
+    else if (sample_count < MAX_SAMPLES)
+        samples[sample_count++] = now() - *(double *)data;
+    if (reply)
+        dbus_message_unref(reply);
+    dbus_pending_call_unref(pending);
+    inflight--;
+}
+
+static void
+send_notify(const Scenario *sc, int i) {
+    DBusMessage *msg = build_notify(sc, i);
+    DBusPendingCall *pending;
+    double *sent = malloc(sizeof(*sent));
+
+    if (!sent || !dbus_connection_send_with_reply(conn, msg, &pending, -1) || !pending)
+        die("cannot send Notify");
+    *sent = now();
+    dbus_pending_call_set_notify(pending, notify_done, sent, free);
+    dbus_message_unref(msg);
+    inflight++;
+}
+
+/* sends count notifications paced at rate, waits for every reply */
+static double
+load(const Scenario *sc, int count, double rate) {
+    double start = now();
+
+    for (int i = 0; i < count; ) {
+        double due = rate ? start + i / rate : 0, t = now();
+        if (inflight < WINDOW && t >= due) {
+            send_notify(sc, i++);
+            continue;
+        }
+        int wait = inflight < WINDOW ? (due - t) * 1000 : -1;
+        dbus_connection_read_write_dispatch(conn, wait);
+    }
+    while (inflight)
+        dbus_connection_read_write_dispatch(conn, -1);
+    return now() - start;
+}
+
+/*
+ * Doubles the offered rate each second until snot stops keeping up,
+ * returns the highest rate it reached
+ */
+static double
+ramp(const Scenario *sc) {
+    double kept = 0;
+
+    for (double rate = 250; rate <= 256000; rate *= 2) {
+        int count = rate;
+        sample_count = 0;
+        double elapsed = load(sc, count, rate);
+        qsort(samples, sample_count, sizeof(double), cmp_double);
+        double reached = count / elapsed;
+        if (reached < rate * 0.9 ||
+            percentile(samples, sample_count, 0.99) > SATURATED_RTT) {
+            if (reached > kept)
+                kept = reached;
+            break;
+        }
+        kept = reached;
+    }
+    return kept;
+}
+
+static int
+has_owner(void) {
+    DBusError err;
+    dbus_error_init(&err);
+    int owned = dbus_bus_name_has_owner(conn, DEST, &err);
+    if (dbus_error_is_set(&err))
+        die(err.message);
+    return owned;
+}
+
+static pid_t
+start_snot(const char *path) {
+    pid_t pid = fork();
+
+    if (pid < 0)
+        die("cannot fork");
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        execl(path, path, (char *)NULL);
+        _exit(127);
+    }
+    for (int tries = 0; !has_owner(); tries++) {
+        if (tries == 500 || waitpid(pid, NULL, WNOHANG) != 0)
+            die("snot did not take the bus name");
+        sleep_ms(10);
+    }
+    return pid;
+}
+
+static void
+stop_snot(pid_t pid, struct rusage *ru) {
+    kill(pid, SIGTERM);
+    if (wait4(pid, NULL, 0, ru) < 0)
+        die("lost snot");
+    /* the next one cannot own the name before the bus lets go of it */
+    while (has_owner())
+        sleep_ms(10);
+}
+
+static void
+get_stats(void) {
+    DBusMessageIter it, array, entry;
+    DBusError err;
+    DBusMessage *msg = dbus_message_new_method_call(DEST, PATH,
+                           "org.snot.Stats", "GetStats");
+    DBusMessage *reply;
+
+    dbus_error_init(&err);
+    if (!msg)
+        die("out of memory");
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+    dbus_message_unref(msg);
+    if (!reply)
+        die(err.message);
+
+    stat_count = 0;
+    dbus_message_iter_init(reply, &it);
+    dbus_message_iter_recurse(&it, &array);
+    for (; dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY &&
+           stat_count < MAX_STATS; dbus_message_iter_next(&array)) {
+        const char *name;
+        dbus_message_iter_recurse(&array, &entry);
+        dbus_message_iter_get_basic(&entry, &name);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_get_basic(&entry, &stats[stat_count].value);
+        snprintf(stats[stat_count].name, sizeof(stats[0].name), "%s", name);
+        stat_count++;
+    }
+    dbus_message_unref(reply);
+}
+
+static double
+stat_value(const char *name) {
+    for (int i = 0; i < stat_count; i++)
+        if (strcmp(stats[i].name, name) == 0)
+            return stats[i].value;
+    return 0;
+}
+
+static double
+seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+run(const Scenario *sc, const char *snot, int first) {
+    struct rusage ru;
+    double elapsed, rate;
+    int count = sc->count;
+    pid_t pid = start_snot(snot);
+
+    sample_count = errors = 0;
+    if (sc->replace) {
+        /* the first one is shown, every other replaces it */
+        DBusError err;
+        Scenario plain = *sc;
+        plain.replace = 0;
+        dbus_error_init(&err);
+        DBusMessage *msg = build_notify(&plain, 0);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(conn,
+                                 msg, -1, &err);
+        dbus_message_unref(msg);
+        if (!reply || !dbus_message_get_args(reply, &err, DBUS_TYPE_UINT32,
+                                             &replaces_id, DBUS_TYPE_INVALID))
+            die(err.message);
+        dbus_message_unref(reply);
+    }
+    if (count) {
+        elapsed = load(sc, count, sc->rate);
+        rate = count / elapsed;
+    } else {
+        rate = ramp(sc);
+        elapsed = count = 0;
+    }
+    qsort(samples, sample_count, sizeof(double), cmp_double);
+
+    sleep_ms(SETTLE);
+    get_stats();
+    stop_snot(pid, &ru);
+
+    printf("%s\n    {\"name\": \"%s\", \"sent\": %d, \"errors\": %d, "
+           "\"seconds\": %.3f, \"rate\": %.1f,\n", first ? "" : ",",
+           sc->name, count, errors, elapsed, rate);
+    printf("     \"rtt_us\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, "
+           "\"max\": %.0f},\n",
+           percentile(samples, sample_count, 0.5) * 1e6,
+           percentile(samples, sample_count, 0.9) * 1e6,
+           percentile(samples, sample_count, 0.99) * 1e6,
+           (sample_count ? samples[sample_count - 1] : 0) * 1e6);
+    printf("     \"first_commit_us\": {\"count\": %.0f, \"p50\": %.0f, "
+           "\"p99\": %.0f, \"max\": %.0f},\n",
+           stat_value("commit_count"), stat_value("commit_p50_us"),
+           stat_value("commit_p99_us"), stat_value("commit_max_us"));
+    printf("     \"rendered\": %.0f, \"replaced\": %.0f, \"dropped\": %.0f,\n",
+           stat_value("rendered"), stat_value("replaced"), stat_value("dropped"));
+    printf("     \"cpu_ms\": {\"user\": %.1f, \"system\": %.1f}, "
+           "\"peak_rss_kb\": %ld}",
+           seconds(ru.ru_utime) * 1e3, seconds(ru.ru_stime) * 1e3,
+           ru.ru_maxrss);
+    fflush(stdout);
+}
+
+int
+main(int argc, char *argv[]) {
+    DBusError err;
+    double rate = 100;
+    int duration = 3, opt;
+
+    while ((opt = getopt(argc, argv, "r:d:")) != -1) {
+        switch (opt) {
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        default: optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || rate <= 0 || duration <= 0)
+        die("usage: bench-e2e [-r rate] [-d seconds] path/to/snot");
+
+    Scenario scenarios[] = {
+        { "steady", rate * duration, rate, 0, 0, 0 },
+        { "burst", 1000, 0, 0, 0, 0 },
+        { "replace", 1000, 0, 0, 1, 0 },
+        { "large", 200, 0, LARGE_BODY, 0, 0 },
+        { "urgency", 600, 0, 0, 0, 1 },
+        { "saturation", 0, 0, 0, 0, 0 },
+    };
+
+    if (!(large_body = malloc(LARGE_BODY + 1)))
+        die("out of memory");
+    memset(large_body, 'x', LARGE_BODY);
+    large_body[LARGE_BODY] = '\0';
+
+    dbus_error_init(&err);
+    if (!(conn = dbus_bus_get(DBUS_BUS_SESSION, &err)))
+        die(err.message);
+
+    printf("{\"version\": \"%s\", \"scenarios\": [", VERSION);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        run(&scenarios[i], argv[optind], i == 0);
+    printf("\n]}\n");
+
+    dbus_connection_unref(conn);
+    free(large_body);
+    return 0;
+}
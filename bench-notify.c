@@ -0,0 +1,224 @@
+/*
+ * Compares N single Notify calls against org.snot.Notify.Batch calls
+ * carrying the same N notifications, BATCH_MAX at a time, and both
+ * against snot's local socket, pipelined one per packet and packed into
+ * as few as fit. Needs a running snot.
+ *
+ * usage: bench-notify [count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dbus/dbus.h>
+#include "sockproto.h"
+#include "dbus.h"
+#include "config.h"
+
+#define DEST "org.freedesktop.Notifications"
+#define PATH "/org/freedesktop/Notifications"
+#define WINDOW 32       /* socket requests in flight, as in snot-send */
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *msg) {
+    fprintf(stderr, "bench-notify: %s\n", msg);
+    exit(1);
+}
+
+/* appends the eight Notify arguments for notification i */
+static void
+append_notify(DBusMessageIter *it, int i) {
+    DBusMessageIter sub;
+    const char *icon = "", *summary = "bench";
+    char app[32], *a = app, body[32], *b = body;
+    uint32_t replaces = 0;
+    int32_t timeout = 1000;
+
+    /* an app of its own each, or the rate limiter folds them after
+     * RATE_BURST and only the aggregate path is measured */
+    snprintf(app, sizeof(app), "bench-notify-%d", i);
+    snprintf(body, sizeof(body), "notification %d", i);
+    dbus_message_iter_append_basic(it, DBUS_TYPE_STRING, &a);
+    dbus_message_iter_append_basic(it, DBUS_TYPE_UINT32, &replaces);
+    dbus_message_iter_append_basic(it, DBUS_TYPE_STRING, &icon);
+    dbus_message_iter_append_basic(it, DBUS_TYPE_STRING, &summary);
+    dbus_message_iter_append_basic(it, DBUS_TYPE_STRING, &b);
+    dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "s", &sub);
+    dbus_message_iter_close_container(it, &sub);
+    dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "{sv}", &sub);
+    dbus_message_iter_close_container(it, &sub);
+    dbus_message_iter_append_basic(it, DBUS_TYPE_INT32, &timeout);
+}
+
+static void
+call(DBusConnection *conn, DBusMessage *msg) {
+    DBusError err;
+    DBusMessage *reply;
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+    if (!reply) {
+        fprintf(stderr, "bench-notify: %s\n", err.message);
+        exit(1);
+    }
+    dbus_message_unref(reply);
+    dbus_message_unref(msg);
+}
+
+static double
+bench_single(DBusConnection *conn, int count) {
+    double start = now();
+
+    for (int i = 0; i < count; i++) {
+        DBusMessageIter it;
+        DBusMessage *msg = dbus_message_new_method_call(DEST, PATH,
+                               "org.freedesktop.Notifications", "Notify");
+        if (!msg)
+            die("out of memory");
+        dbus_message_iter_init_append(msg, &it);
+        append_notify(&it, i);
+        call(conn, msg);
+    }
+    return now() - start;
+}
+
+/* as few Batch calls as BATCH_MAX allows */
+static double
+bench_batch(DBusConnection *conn, int count) {
+    DBusMessageIter it, array, entry;
+    double start = now();
+
+    for (int sent = 0; sent < count; ) {
+        DBusMessage *msg = dbus_message_new_method_call(DEST, PATH,
+                               "org.snot.Notify", "Batch");
+        if (!msg)
+            die("out of memory");
+        dbus_message_iter_init_append(msg, &it);
+        dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY,
+                                         "(susssasa{sv}i)", &array);
+        for (int i = 0; i < BATCH_MAX && sent < count; i++, sent++) {
+            dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+            append_notify(&entry, sent);
+            dbus_message_iter_close_container(&array, &entry);
+        }
+        dbus_message_iter_close_container(&it, &array);
+        call(conn, msg);
+    }
+    return now() - start;
+}
+
+static int
+connect_snot(void) {
+    struct sockaddr_un addr;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+             dir ? dir : ".", SOCKET_NAME);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+    return fd;
+}
+
+/* one packet with up to count notifications, returns how many fit */
+static int
+sock_send(int fd, int first, int count) {
+    static char buf[SOCK_PACKET_MAX];
+    SockHeader hdr = { SOCK_MAGIC, 0 };
+    size_t off = sizeof(hdr), next;
+    char app[32], body[32];
+    SockNotify n = { app, "", "bench", body, 0, 1000, 1 };
+
+    for (; (int)hdr.count < count; hdr.count++, off = next) {
+        snprintf(app, sizeof(app), "bench-notify-%d", first + hdr.count);
+        snprintf(body, sizeof(body), "notification %d", first + hdr.count);
+        if (!(next = sock_pack(buf, sizeof(buf), off, &n)))
+            break;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    if (send(fd, buf, off, 0) < 0)
+        die("send failed");
+    return hdr.count;
+}
+
+static void
+sock_reply(int fd) {
+    static char buf[SOCK_PACKET_MAX];
+
+    if (recv(fd, buf, sizeof(buf), 0) < (ssize_t)sizeof(SockHeader))
+        die("no reply on the local socket");
+}
+
+static double
+bench_sock(int fd, int count, int batch) {
+    double start = now();
+    int inflight = 0;
+
+    for (int sent = 0; sent < count; ) {
+        sent += sock_send(fd, sent, batch ? count - sent : 1);
+        if (++inflight == WINDOW) {
+            sock_reply(fd);
+            inflight--;
+        }
+    }
+    while (inflight--)
+        sock_reply(fd);
+    return now() - start;
+}
+
+int
+main(int argc, char *argv[]) {
+    DBusError err;
+    DBusConnection *conn;
+    int count = argc > 1 ? atoi(argv[1]) : 100;
+
+    if (count <= 0)
+        die("count must be positive");
+
+    dbus_error_init(&err);
+    conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+    if (!conn)
+        die(err.message);
+
+    double single = bench_single(conn, count);
+    double batch = bench_batch(conn, count);
+
+    printf("%d x Notify: %8.3f ms (%.1f us each)\n",
+           count, single * 1e3, single * 1e6 / count);
+    printf("%d x Batch(%d): %8.3f ms (%.1f us each)\n",
+           (count + BATCH_MAX - 1) / BATCH_MAX, count,
+           batch * 1e3, batch * 1e6 / count);
+    printf("speedup: %.1fx\n", single / batch);
+
+    int fd = connect_snot();
+    if (fd < 0) {
+        printf("local socket: not available\n");
+    } else {
+        double piped = bench_sock(fd, count, 0);
+        double packed = bench_sock(fd, count, 1);
+
+        printf("%d x socket: %8.3f ms (%.1f us each)\n",
+               count, piped * 1e3, piped * 1e6 / count);
+        printf("socket batch(%d): %8.3f ms (%.1f us each)\n",
+               count, packed * 1e3, packed * 1e6 / count);
+        printf("socket vs Notify: %.1fx\n", single / piped);
+        close(fd);
+    }
+
+    dbus_connection_unref(conn);
+    return 0;
+}
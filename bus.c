@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include "bus.h"
+#include "dbus.h"
+#include "snot.h"
+#include "latency.h"
+#include "ratelimit.h"
+#include "config.h"
+
+const char *const bus_capabilities[] = {
+    "body",
+    "body-markup",
+    "actions",
+    "icon-static",
+    NULL
+};
+
+/*
+ * Notify replies held back while the pending queue is above
+ * QUEUE_HIGH_WATER, so that senders waiting on them slow down. They are
+ * released in arrival order once it drains to QUEUE_LOW_WATER, or after
+ * REPLY_HOLD_MAX ms so no client is stalled past its call timeout.
+ */
+static struct {
+    void *reply;
+    uint64_t received;
+    unsigned long since;
+} held[HELD_MAX];
+static int held_len = 0;
+static bool throttling = false;
+static DBusHoldStats hold_stats;
+static DBusBatchStats batch_stats;
+
+/* unique bus names are never reused, so a name's pid can be kept until
+ * its slot is needed again. Until the bus has answered, pid is a stand-in
+ * key of the connection's own, above any real pid. */
+#define PID_PENDING 0x80000000u
+static struct {
+    char name[32];
+    uint32_t pid;
+} pid_cache[PID_CACHE_SIZE];
+static uint32_t next_pending;
+
+static void
+update_throttling(void) {
+    unsigned int depth = queue_get_stats()->depth;
+
+    if (depth >= QUEUE_HIGH_WATER)
+        throttling = true;
+    else if (depth <= QUEUE_LOW_WATER)
+        throttling = false;
+}
+
+/* keeps reply for later if backpressure is on; returns false if it
+ * should be sent now */
+bool
+bus_hold_reply(void *reply, uint64_t received) {
+    if (!BACKPRESSURE)
+        return false;
+    update_throttling();
+    if (!throttling)
+        return false;
+    if (held_len == HELD_MAX) {
+        hold_stats.unheld++;
+        return false;
+    }
+
+    held[held_len].reply = reply;
+    held[held_len].received = received;
+    held[held_len].since = latency_now_ms();
+    held_len++;
+    hold_stats.held++;
+    hold_stats.outstanding = held_len;
+    return true;
+}
+
+/*
+ * Sends the held replies that may go now. Returns the ms until the
+ * oldest one still held times out, or -1 if none are held.
+ */
+long
+bus_release_replies(BusSendFn send) {
+    unsigned long now = latency_now_ms();
+    int i = 0;
+
+    if (!held_len)
+        return -1;
+
+    update_throttling();
+    for (; i < held_len; i++) {
+        if (throttling && now - held[i].since < REPLY_HOLD_MAX)
+            break;
+        if (throttling)
+            hold_stats.timed_out++;
+        send(held[i].reply, held[i].received);
+    }
+    memmove(held, held + i, (held_len - i) * sizeof(held[0]));
+    held_len -= i;
+    hold_stats.outstanding = held_len;
+
+    return held_len ? (long)(held[0].since + REPLY_HOLD_MAX - now) : -1;
+}
+
+void
+bus_flush_held(BusSendFn send) {
+    for (int i = 0; i < held_len; i++)
+        send(held[i].reply, held[i].received);
+    held_len = 0;
+    hold_stats.outstanding = 0;
+}
+
+static int
+pid_slot(const char *sender) {
+    uint32_t h = 2166136261u;
+
+    for (const char *p = sender; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % PID_CACHE_SIZE;
+}
+
+/*
+ * Never waits on the bus: a sender not seen before gets a stand-in key,
+ * so it is rate limited per connection, while query asks the bus in the
+ * background. bus_set_pid() fills the answer in and moves the stand-in's
+ * buckets over to it.
+ */
+uint32_t
+bus_sender_pid(const char *sender, int (*query)(const char *)) {
+    if (!sender)
+        return 0;
+    int h = pid_slot(sender);
+    if (strcmp(pid_cache[h].name, sender) == 0)
+        return pid_cache[h].pid;
+
+    snprintf(pid_cache[h].name, sizeof(pid_cache[h].name), "%s", sender);
+    pid_cache[h].pid = PID_PENDING | (next_pending++ & ~PID_PENDING);
+    if (query(sender) < 0) {
+        pid_cache[h].name[0] = '\0';   /* try again on the next call */
+        return 0;
+    }
+    return pid_cache[h].pid;
+}
+
+void
+bus_set_pid(const char *sender, uint32_t pid) {
+    int h = pid_slot(sender);
+
+    /* the slot may have gone to another name in the meantime */
+    if (strcmp(pid_cache[h].name, sender) != 0 || pid_cache[h].pid == pid)
+        return;
+    ratelimit_rekey(pid_cache[h].pid, pid, latency_now_ms());
+    pid_cache[h].pid = pid;
+}
+
+void
+bus_count_batch(int count) {
+    batch_stats.batches++;
+    batch_stats.notifications += count;
+}
+
+const DBusHoldStats *
+dbus_get_hold_stats(void) {
+    return &hold_stats;
+}
+
+const DBusBatchStats *
+dbus_get_batch_stats(void) {
+    return &batch_stats;
+}
@@ -0,0 +1,36 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The part of the D-Bus service that does not depend on the library
+ * talking to the bus. Both backends, dbus.c on libdbus and sdbus.c on
+ * sd-bus, build on it; snot.c only ever sees dbus.h.
+ */
+#define BUS_SERVER_NAME "snot"
+#define BUS_SERVER_VENDOR "snot"
+#define BUS_SERVER_VERSION "1.0"
+#define BUS_SPEC_VERSION "1.2"
+
+extern const char *const bus_capabilities[];
+
+/* replies are opaque here; the backend refs a reply before handing it
+ * over and its send callback sends and unrefs it. received is when the
+ * call it answers arrived, kept for LAT_REPLY. */
+typedef void (*BusSendFn)(void *reply, uint64_t received);
+
+bool bus_hold_reply(void *reply, uint64_t received);
+long bus_release_replies(BusSendFn send);
+void bus_flush_held(BusSendFn send);
+
+/* query starts an asynchronous lookup of the pid behind a unique name,
+ * returns -1 if it could not; the backend passes the answer on to
+ * bus_set_pid() */
+uint32_t bus_sender_pid(const char *sender, int (*query)(const char *));
+void bus_set_pid(const char *sender, uint32_t pid);
+
+void bus_count_batch(int count);
+
+#endif
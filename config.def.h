@@ -11,11 +11,41 @@
 #define FOREGROUND_COLOR "#bbbbbb"        /* text color in hex */
 #define BORDER_COLOR "#005577"            /* border color in hex */
 #define FONT "Liberation Mono 10"               /* font name and size */
+#define BADGE_FONT "Liberation Mono 7"    /* font of the "×N" repeat badge */
+#define BADGE_WIDTH 40                    /* width of the repeat badge in px */
+#define ICON_SIZE 48                      /* icon box edge in px */
+#define ICON_MAX_SIZE 256                 /* upper bound for ICON_SIZE */
+#define ICON_CACHE_BUDGET (4 << 20)       /* bytes of decoded icons kept */
+#define ICON_CACHE_RECHECK 2              /* seconds between mtime checks */
+#define ICON_DECODE_QUEUE 32              /* icons waiting for the decode worker */
+#define ICON_THEME "hicolor"              /* icon theme for named icons; only its PNGs are used, so pick one that ships them */
+#define ICON_INDEX_BUCKETS 4096           /* hash buckets of the icon theme index */
 
 /* behavior */
+#define LOG_LEVEL LOG_INFO                /* LOG_ERROR to LOG_DEBUG, anything above is compiled out */
 #define DURATION 3000                     /* notification display duration in ms */
 #define FADE_TIME 200                     /* fade animation duration in ms */
 #define MAX_NOTIFICATIONS 5               /* maximum number of notifications shown */
+#define PENDING_MAX 64                    /* notifications queued behind the shown ones */
+#define PENDING_CRITICAL 16               /* extra queue slots only critical notifications may take */
+#define QUEUE_POLICY QUEUE_COLLAPSE       /* QUEUE_DROP_OLDEST, QUEUE_DROP_NEWEST or QUEUE_COLLAPSE */
+#define BACKPRESSURE 0                    /* 1: hold Notify replies while the queue is backed up */
+#define QUEUE_HIGH_WATER 48               /* queued notifications that start holding replies */
+#define QUEUE_LOW_WATER 16                /* queued notifications that release them again */
+#define REPLY_HOLD_MAX 5000               /* ms a reply is held at most, below the D-Bus call timeout */
+#define BURST_WINDOW 16                   /* ms a burst is gathered before mapping, a lone one maps at once */
+#define BURST_WINDOW_LOW 250              /* the same for low urgency, critical ones never wait */
+#define RATE_BURST 5                      /* notifications an app may send back to back */
+#define RATE_REFILL 2000                  /* ms until a rate limited app may send one more */
+#define RATE_SENDERS 128                  /* apps tracked for rate limiting */
+#define SOCKET_NAME "snot.sock"           /* local socket in $XDG_RUNTIME_DIR */
+#define SOCKET_CLIENTS 16                 /* local socket connections served at once */
+#define STATS_SOCKET_NAME "snot-stats.sock" /* text stats dump in $XDG_RUNTIME_DIR */
+#define PID_LOOKUP_TIMEOUT 100            /* ms the bus has to name a sender's pid, asked in the background */
+#define DEDUP_WINDOW 10000                /* ms a repeat is folded into the earlier one */
+#define DEDUP_KEY (DEDUP_APP | DEDUP_SUMMARY | DEDUP_BODY) /* fields that must match, 0 disables */
+#define STRING_BLOCK 512                  /* bytes of text a notification holds without a malloc */
+#define BUFFER_POOL 4                     /* released shm buffers kept for reuse, oldest idle one goes first */
 #define SPACING 10                        /* space between notifications */
 #define NOTIFICATION_MIN_WIDTH 300        /* minimum width */
 #define NOTIFICATION_MIN_HEIGHT 50        /* minimum height */  
@@ -7,12 +7,31 @@ WLROOTS_DIR ?= $(shell pkg-config --variable=prefix wlroots 2>/dev/null)
 
 PKG_CONFIG = pkg-config
 
+# D-Bus backend: libdbus (dbus.c) or sdbus (sdbus.c, needs libsystemd)
+BUS = libdbus
+
+ifeq ($(BUS),sdbus)
+    BUS_SRC = sdbus.c
+    BUS_PKG = libsystemd
+    BUS_CPPFLAGS = -DBUS_SDBUS
+else
+    BUS_SRC = dbus.c
+    BUS_PKG = dbus-1
+endif
+
+# USDT probes for bpftrace and perf, see bpf/ (needs sys/sdt.h)
+USDT = 0
+
+ifeq ($(USDT),1)
+    USDT_CPPFLAGS = -DSNOT_USDT
+endif
+
 INCS = $(shell ${PKG_CONFIG} --cflags pixman-1) \
        $(shell ${PKG_CONFIG} --cflags libdrm) \
        $(shell ${PKG_CONFIG} --cflags pango) \
        $(shell ${PKG_CONFIG} --cflags pangocairo) \
        $(shell ${PKG_CONFIG} --cflags cairo) \
-       $(shell ${PKG_CONFIG} --cflags dbus-1)
+       $(shell ${PKG_CONFIG} --cflags ${BUS_PKG})
 
 ifeq ($(WLROOTS_DIR),)
     INCS += $(shell ${PKG_CONFIG} --cflags wlroots)
@@ -23,7 +42,7 @@ endif
 LIBS = $(shell ${PKG_CONFIG} --libs wayland-client) \
        $(shell ${PKG_CONFIG} --libs pangocairo) \
        $(shell ${PKG_CONFIG} --libs cairo) \
-       $(shell ${PKG_CONFIG} --libs dbus-1)
+       $(shell ${PKG_CONFIG} --libs ${BUS_PKG})
 
 ifeq ($(WLROOTS_DIR),)
     LIBS += $(shell ${PKG_CONFIG} --libs wlroots)
@@ -31,8 +50,8 @@ else
     LIBS += -L$(WLROOTS_DIR)/lib -lwlroots
 endif
 
-CPPFLAGS = -D_DEFAULT_SOURCE
-CFLAGS = -O2 -Wall ${INCS} ${CPPFLAGS}
-LDFLAGS = ${LIBS}
+CPPFLAGS = -D_DEFAULT_SOURCE ${BUS_CPPFLAGS} ${USDT_CPPFLAGS}
+CFLAGS = -O2 -Wall -pthread ${INCS} ${CPPFLAGS}
+LDFLAGS = ${LIBS} -pthread
 
 CC = gcc
\ No newline at end of file
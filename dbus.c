@@ -7,11 +7,34 @@
 #include <dbus/dbus.h>
 #include "dbus.h"
 #include "snot.h"
+#include "hints.h"
+#include "bus.h"
+#include "latency.h"
+#include "stats.h"
+#include "log.h"
 #include "config.h"
 
 
 static DBusConnection *connection;
-static uint32_t next_notification_id = 1;
+
+/* watches handed to us by libdbus, polled from the main loop */
+static DBusWatch *watches[MAX_WATCHES];
+static int watch_count = 0;
+
+/* the same for timeouts, with the ms each is next due */
+static struct {
+    DBusTimeout *timeout;
+    unsigned long due;
+} timeouts[MAX_TIMEOUTS];
+static int timeout_count = 0;
+
+/* replies and signals queued during a dispatch pass, sent once the bus
+ * socket is reported writable */
+static DBusMessage *outbox[OUTBOX_SIZE];
+static uint64_t outbox_received[OUTBOX_SIZE];   /* Notify arrival, 0 if none */
+static int outbox_len = 0;
+
+static DBusFlushStats flush_stats;
 
 /* https://dbus.freedesktop.org/doc/dbus-api-design.html */
 static const char introspection_xml[] =
@@ -39,14 +62,178 @@ static const char introspection_xml[] =
     "    <method name=\"GetCapabilities\">\n"
     "      <arg name=\"capabilities\" type=\"as\" direction=\"out\"/>\n"
     "    </method>\n"
+    "    <signal name=\"NotificationClosed\">\n"
+    "      <arg name=\"id\" type=\"u\"/>\n"
+    "      <arg name=\"reason\" type=\"u\"/>\n"
+    "    </signal>\n"
+    "  </interface>\n"
+    "  <interface name=\"org.snot.Notify\">\n"
+    "    <method name=\"Batch\">\n"
+    "      <arg name=\"notifications\" type=\"a(susssasa{sv}i)\" direction=\"in\"/>\n"
+    "      <arg name=\"ids\" type=\"au\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "  </interface>\n"
+    "  <interface name=\"org.snot.Stats\">\n"
+    "    <method name=\"GetStats\">\n"
+    "      <arg name=\"stats\" type=\"a{sd}\" direction=\"out\"/>\n"
+    "    </method>\n"
     "  </interface>\n"
     "</node>\n";
 
+static dbus_bool_t
+add_watch(DBusWatch *watch, void *data) {
+    if (watch_count >= MAX_WATCHES)
+        return FALSE;
+    watches[watch_count++] = watch;
+    return TRUE;
+}
+
+static void
+remove_watch(DBusWatch *watch, void *data) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i] == watch) {
+            watches[i] = watches[--watch_count];
+            return;
+        }
+    }
+}
+
+static void
+toggle_watch(DBusWatch *watch, void *data) {
+    /* enabled state is re-read on every dbus_prepare() */
+}
+
+static dbus_bool_t
+add_timeout(DBusTimeout *timeout, void *data) {
+    if (timeout_count >= MAX_TIMEOUTS)
+        return FALSE;
+    timeouts[timeout_count].timeout = timeout;
+    timeouts[timeout_count].due = latency_now_ms() +
+                                  dbus_timeout_get_interval(timeout);
+    timeout_count++;
+    return TRUE;
+}
+
+static void
+remove_timeout(DBusTimeout *timeout, void *data) {
+    for (int i = 0; i < timeout_count; i++) {
+        if (timeouts[i].timeout == timeout) {
+            timeouts[i] = timeouts[--timeout_count];
+            return;
+        }
+    }
+}
+
+/* a timeout that is switched back on starts its interval over */
+static void
+toggle_timeout(DBusTimeout *timeout, void *data) {
+    for (int i = 0; i < timeout_count; i++)
+        if (timeouts[i].timeout == timeout)
+            timeouts[i].due = latency_now_ms() +
+                              dbus_timeout_get_interval(timeout);
+}
+
+/* handles the due ones; a handled timeout may remove itself */
+static void
+handle_timeouts(void) {
+    unsigned long now = latency_now_ms();
+
+    for (int i = 0; i < timeout_count; i++) {
+        DBusTimeout *t = timeouts[i].timeout;
+        if (!dbus_timeout_get_enabled(t) || (long)(timeouts[i].due - now) > 0)
+            continue;
+        timeouts[i].due = now + dbus_timeout_get_interval(t);
+        dbus_timeout_handle(t);
+    }
+}
+
+static void
+flush_outbox(void) {
+    for (int i = 0; i < outbox_len; i++) {
+        dbus_connection_send(connection, outbox[i], NULL);
+        dbus_message_unref(outbox[i]);
+        latency_record(LAT_REPLY, outbox_received[i]);
+    }
+
+    flush_stats.flushes++;
+    flush_stats.messages += outbox_len;
+    flush_stats.last_messages = outbox_len;
+    if ((unsigned long)outbox_len > flush_stats.max_messages)
+        flush_stats.max_messages = outbox_len;
+    outbox_len = 0;
+}
+
+/* received: when the call this replies to arrived, for LAT_REPLY */
+static void
+queue_message(DBusMessage *msg, uint64_t received) {
+    /* outbox full, hand what is queued to libdbus first to keep order */
+    if (outbox_len >= OUTBOX_SIZE)
+        flush_outbox();
+    outbox_received[outbox_len] = received;
+    outbox[outbox_len++] = dbus_message_ref(msg);
+}
+
+static void
+send_message(DBusMessage *msg) {
+    queue_message(msg, 0);
+}
+
+/* LazyHint on libdbus: the message plus an iterator at the variant */
+void
+lazy_hint_retain(LazyHint *dst, const LazyHint *src) {
+    *dst = *src;
+    if (dst->msg)
+        dbus_message_ref(dst->msg);
+}
+
+void
+lazy_hint_release(LazyHint *h) {
+    if (h->msg)
+        dbus_message_unref(h->msg);
+    h->msg = NULL;
+    h->key = HINT_UNKNOWN;
+}
+
+/* borrows the pixel array straight out of the message, no copy is made */
 int
-dbus_get_fd(void) {
-    int fd;
-    dbus_connection_get_unix_process_id(connection, &fd);
-    return fd;
+hint_get_image(const LazyHint *h, ImageData *img) {
+    DBusMessageIter st, arr;
+    dbus_bool_t has_alpha;
+
+    if (!h->msg)
+        return -1;
+
+    DBusMessageIter it = h->iter;
+    if (dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_STRUCT)
+        return -1;
+    dbus_message_iter_recurse(&it, &st);
+
+    int32_t *fields[] = {
+        &img->width, &img->height, &img->rowstride,
+        NULL, &img->bits_per_sample, &img->channels,
+    };
+    for (int i = 0; i < 6; i++) {
+        int type = dbus_message_iter_get_arg_type(&st);
+        if (!fields[i]) {
+            if (type != DBUS_TYPE_BOOLEAN)
+                return -1;
+            dbus_message_iter_get_basic(&st, &has_alpha);
+        } else {
+            if (type != DBUS_TYPE_INT32)
+                return -1;
+            dbus_message_iter_get_basic(&st, fields[i]);
+        }
+        dbus_message_iter_next(&st);
+    }
+    img->has_alpha = has_alpha;
+
+    if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY ||
+        dbus_message_iter_get_element_type(&st) != DBUS_TYPE_BYTE)
+        return -1;
+    dbus_message_iter_recurse(&st, &arr);
+    dbus_message_iter_get_fixed_array(&arr, &img->pixels, &img->len);
+
+    return image_valid(img) ? 0 : -1;
 }
 
 static DBusHandlerResult
@@ -55,10 +242,10 @@ method_get_server_information(DBusConnection *conn, DBusMessage *msg) {
     if (!reply)
         return DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-    const char *name = "snot";
-    const char *vendor = "snot";
-    const char *version = "1.0";
-    const char *spec_version = "1.2";
+    const char *name = BUS_SERVER_NAME;
+    const char *vendor = BUS_SERVER_VENDOR;
+    const char *version = BUS_SERVER_VERSION;
+    const char *spec_version = BUS_SPEC_VERSION;
 
     dbus_message_append_args(reply,
                            DBUS_TYPE_STRING, &name,
@@ -67,7 +254,7 @@ method_get_server_information(DBusConnection *conn, DBusMessage *msg) {
                            DBUS_TYPE_STRING, &spec_version,
                            DBUS_TYPE_INVALID);
 
-    dbus_connection_send(conn, reply, NULL);
+    send_message(reply);
     dbus_message_unref(reply);
 
     return DBUS_HANDLER_RESULT_HANDLED;
@@ -83,85 +270,240 @@ method_get_capabilities(DBusConnection *conn, DBusMessage *msg) {
     dbus_message_iter_init_append(reply, &iter);
     dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
 
-    const char *capabilities[] = {
-        "body",
-        "body-markup",
-        "actions",
-        NULL
-    };
-
-    for (const char **cap = capabilities; *cap; cap++) {
+    for (const char *const *cap = bus_capabilities; *cap; cap++) {
         dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, cap);
     }
 
     dbus_message_iter_close_container(&iter, &array);
-    dbus_connection_send(conn, reply, NULL);
+    send_message(reply);
     dbus_message_unref(reply);
 
     return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-static DBusHandlerResult
-handle_notification_method(DBusConnection *conn, DBusMessage *msg) {
-    DBusMessageIter iter;
-    char *app_name = NULL, *app_icon = NULL, *summary = NULL, *body = NULL;
-    uint32_t replaces_id = 0;
-    int32_t expire_timeout = -1;
+/* walks a{sv} once; known keys are picked out by hint_lookup(), large
+ * payloads only have their position recorded */
+static void
+parse_hints(DBusMessage *msg, DBusMessageIter *iter, Hints *h) {
+    DBusMessageIter dict, entry, variant;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+        return;
+
+    dbus_message_iter_recurse(iter, &dict);
+    for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+           dbus_message_iter_next(&dict)) {
+        const char *key;
+        dbus_message_iter_recurse(&dict, &entry);
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+            continue;
+        dbus_message_iter_get_basic(&entry, &key);
+
+        int id = hint_lookup(key);
+        if (id == HINT_UNKNOWN || !dbus_message_iter_next(&entry))
+            continue;
+
+        dbus_message_iter_recurse(&entry, &variant);
+        int type = dbus_message_iter_get_arg_type(&variant);
+
+        switch (id) {
+        case HINT_URGENCY:
+            if (type == DBUS_TYPE_BYTE) {
+                uint8_t urgency;
+                dbus_message_iter_get_basic(&variant, &urgency);
+                h->urgency = MIN(urgency, URGENCY_CRITICAL);
+            }
+            break;
+        case HINT_VALUE:
+            if (type == DBUS_TYPE_INT32 || type == DBUS_TYPE_UINT32) {
+                int32_t value;
+                dbus_message_iter_get_basic(&variant, &value);
+                h->value = MAX(0, MIN(value, 100));
+            }
+            break;
+        case HINT_TRANSIENT:
+        case HINT_RESIDENT:
+            if (type == DBUS_TYPE_BOOLEAN) {
+                dbus_bool_t b;
+                dbus_message_iter_get_basic(&variant, &b);
+                if (id == HINT_TRANSIENT)
+                    h->transient = b;
+                else
+                    h->resident = b;
+            }
+            break;
+        case HINT_CATEGORY:
+        case HINT_IMAGE_PATH:
+        case HINT_DESKTOP_ENTRY:
+        case HINT_STACK_TAG:
+            if (type == DBUS_TYPE_STRING) {
+                const char *str;
+                dbus_message_iter_get_basic(&variant, &str);
+                if (id == HINT_CATEGORY)
+                    h->category = str;
+                else if (id == HINT_IMAGE_PATH)
+                    h->image_path = str;
+                else if (id == HINT_DESKTOP_ENTRY)
+                    h->desktop_entry = str;
+                else
+                    h->stack_tag = str;
+            }
+            break;
+        case HINT_IMAGE_DATA:
+        case HINT_ICON_DATA:
+            /* image-data wins over the deprecated icon_data */
+            if (type == DBUS_TYPE_STRUCT &&
+                (id == HINT_IMAGE_DATA || h->image_data.key == HINT_UNKNOWN)) {
+                h->image_data.msg = msg;
+                h->image_data.iter = variant;
+                h->image_data.key = id;
+            }
+            break;
+        }
+    }
+}
 
-    printf("Received notification request\n");
+/* ownership of a held reply passes to bus.c until send_held() */
+static bool
+hold_reply(DBusMessage *reply, uint64_t received) {
+    if (bus_hold_reply(dbus_message_ref(reply), received))
+        return true;
+    dbus_message_unref(reply);
+    return false;
+}
 
-    if (!dbus_message_iter_init(msg, &iter)) {
-        fprintf(stderr, "Message has no arguments\n");
-        goto error;
+static void
+send_held(void *reply, uint64_t received) {
+    queue_message(reply, received);
+    dbus_message_unref(reply);
+}
+
+static void
+pid_reply(DBusPendingCall *pending, void *data) {
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+    uint32_t pid;
+
+    if (!reply)
+        return;
+    if (dbus_message_get_args(reply, NULL, DBUS_TYPE_UINT32, &pid,
+                              DBUS_TYPE_INVALID))
+        bus_set_pid(data, pid);
+    dbus_message_unref(reply);
+}
+
+static int
+query_pid(const char *sender) {
+    DBusMessage *call;
+    DBusPendingCall *pending = NULL;
+    char *name;
+
+    call = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                        DBUS_INTERFACE_DBUS,
+                                        "GetConnectionUnixProcessID");
+    if (!call)
+        return -1;
+    dbus_message_append_args(call, DBUS_TYPE_STRING, &sender,
+                             DBUS_TYPE_INVALID);
+    if (!dbus_connection_send_with_reply(connection, call, &pending,
+                                         PID_LOOKUP_TIMEOUT) || !pending) {
+        dbus_message_unref(call);
+        return -1;
     }
+    dbus_message_unref(call);
 
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING) {
-        fprintf(stderr, "First argument is not a string\n");
-        goto error;
+    if (!(name = strdup(sender)) ||
+        !dbus_pending_call_set_notify(pending, pid_reply, name, free)) {
+        free(name);
+        dbus_pending_call_cancel(pending);
+        dbus_pending_call_unref(pending);
+        return -1;
     }
-    dbus_message_iter_get_basic(&iter, &app_name);
-    printf("App name: %s\n", app_name);
-    if (!dbus_message_iter_next(&iter)) goto error;
+    dbus_pending_call_unref(pending);
+    return 0;
+}
 
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32) goto error;
-    dbus_message_iter_get_basic(&iter, &replaces_id);
-    printf("Replaces ID: %u\n", replaces_id);
-    if (!dbus_message_iter_next(&iter)) goto error;
+/*
+ * Reads one notification's (susssasa{sv}i) from iter, which is either the
+ * Notify arguments themselves or one struct of a Batch array, and inserts
+ * it. Returns 0 on success and stores the new id.
+ */
+static int
+notify_one(DBusMessage *msg, DBusMessageIter *iter, uint32_t pid, uint32_t *id) {
+    char *app_name = NULL, *app_icon = NULL, *summary = NULL, *body = NULL;
+    uint32_t replaces_id = 0;
+    int32_t expire_timeout = -1;
+    Hints hints;
 
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING) goto error;
-    dbus_message_iter_get_basic(&iter, &app_icon);
-    printf("App icon: %s\n", app_icon);
-    if (!dbus_message_iter_next(&iter)) goto error;
+    hints_init(&hints);
 
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING) goto error;
-    dbus_message_iter_get_basic(&iter, &summary);
-    printf("Summary: %s\n", summary);
-    if (!dbus_message_iter_next(&iter)) goto error;
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) {
+        fprintf(stderr, "First argument is not a string\n");
+        return -1;
+    }
+    dbus_message_iter_get_basic(iter, &app_name);
+    log_debug("App name: %s\n", app_name);
+    if (!dbus_message_iter_next(iter)) return -1;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_UINT32) return -1;
+    dbus_message_iter_get_basic(iter, &replaces_id);
+    log_debug("Replaces ID: %u\n", replaces_id);
+    if (!dbus_message_iter_next(iter)) return -1;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) return -1;
+    dbus_message_iter_get_basic(iter, &app_icon);
+    log_debug("App icon: %s\n", app_icon);
+    if (!dbus_message_iter_next(iter)) return -1;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) return -1;
+    dbus_message_iter_get_basic(iter, &summary);
+    log_debug("Summary: %s\n", summary);
+    if (!dbus_message_iter_next(iter)) return -1;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) return -1;
+    dbus_message_iter_get_basic(iter, &body);
+    log_debug("Body: %s\n", body);
+
+    if (!dbus_message_iter_next(iter)) return -1;
+    if (!dbus_message_iter_next(iter)) return -1;
+
+    parse_hints(msg, iter, &hints);
+    if (!dbus_message_iter_next(iter)) return -1;
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_INT32) return -1;
+    dbus_message_iter_get_basic(iter, &expire_timeout);
+
+    log_debug("Creating notification...\n");
+    *id = add_notification(summary, body, app_name, app_icon,
+                           replaces_id, expire_timeout, &hints, pid);
+    log_debug("Notification created\n");
+    return 0;
+}
 
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING) goto error;
-    dbus_message_iter_get_basic(&iter, &body);
-    printf("Body: %s\n", body);
+static DBusHandlerResult
+handle_notification_method(DBusConnection *conn, DBusMessage *msg) {
+    DBusMessageIter iter;
+    uint32_t id;
 
-    if (!dbus_message_iter_next(&iter)) goto error;
-    if (!dbus_message_iter_next(&iter)) goto error;
+    uint64_t received = latency_receive();
+    log_debug("Received notification request\n");
 
-    if (!dbus_message_iter_next(&iter)) goto error;
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_INT32) goto error;
-    dbus_message_iter_get_basic(&iter, &expire_timeout);
+    if (!dbus_message_iter_init(msg, &iter)) {
+        fprintf(stderr, "Message has no arguments\n");
+        goto error;
+    }
 
-    printf("Creating notification...\n");
-    add_notification(summary, body, app_name, replaces_id, expire_timeout);
-    printf("Notification created\n");
+    uint32_t pid = bus_sender_pid(dbus_message_get_sender(msg), query_pid);
+    if (notify_one(msg, &iter, pid, &id) < 0)
+        goto error;
 
     DBusMessage *reply = dbus_message_new_method_return(msg);
     if (reply) {
-        uint32_t id = next_notification_id++;
         dbus_message_append_args(reply,
                                DBUS_TYPE_UINT32, &id,
                                DBUS_TYPE_INVALID);
-        dbus_connection_send(conn, reply, NULL);
+        if (!hold_reply(reply, received))
+            queue_message(reply, received);
         dbus_message_unref(reply);
-        printf("Reply sent, ID: %u\n", id);
+        log_debug("Reply queued, ID: %u\n", id);
     }
 
     return DBUS_HANDLER_RESULT_HANDLED;
@@ -171,12 +513,100 @@ error:
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+/*
+ * org.snot.Notify.Batch(a(susssasa{sv}i)) -> au: up to BATCH_MAX Notify
+ * calls in one message and one reply. Entries go through the same path
+ * as Notify, so they also land in the same burst. A malformed entry gets
+ * id 0 and does not stop the rest; a longer batch is refused whole with
+ * LimitsExceeded, before any of it is shown.
+ */
+static DBusHandlerResult
+handle_batch_method(DBusConnection *conn, DBusMessage *msg) {
+    DBusMessageIter iter, array, entry, out, ids;
+    uint32_t ids_buf[BATCH_MAX];
+    uint64_t received = latency_receive();
+    int count = 0;
+
+    if (!dbus_message_iter_init(msg, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY ||
+        dbus_message_iter_get_element_type(&iter) != DBUS_TYPE_STRUCT) {
+        fprintf(stderr, "Batch expects a(susssasa{sv}i)\n");
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    if (dbus_message_iter_get_element_count(&iter) > BATCH_MAX) {
+        DBusMessage *error = dbus_message_new_error_printf(msg,
+            DBUS_ERROR_LIMITS_EXCEEDED,
+            "Batch takes at most %d notifications", BATCH_MAX);
+        if (!error)
+            return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        queue_message(error, received);
+        dbus_message_unref(error);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    uint32_t pid = bus_sender_pid(dbus_message_get_sender(msg), query_pid);
+    dbus_message_iter_recurse(&iter, &array);
+    for (; dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT &&
+           count < BATCH_MAX;
+           dbus_message_iter_next(&array)) {
+        dbus_message_iter_recurse(&array, &entry);
+        if (notify_one(msg, &entry, pid, &ids_buf[count]) < 0)
+            ids_buf[count] = 0;
+        count++;
+    }
+
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    if (!reply)
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+    const uint32_t *p = ids_buf;
+    dbus_message_iter_init_append(reply, &out);
+    dbus_message_iter_open_container(&out, DBUS_TYPE_ARRAY,
+                                     DBUS_TYPE_UINT32_AS_STRING, &ids);
+    dbus_message_iter_append_fixed_array(&ids, DBUS_TYPE_UINT32, &p, count);
+    dbus_message_iter_close_container(&out, &ids);
+
+    if (!hold_reply(reply, received))
+        queue_message(reply, received);
+    dbus_message_unref(reply);
+    bus_count_batch(count);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* org.snot.Stats.GetStats() -> a{sd}, the same entries as the stats socket */
+static DBusHandlerResult
+method_get_stats(DBusConnection *conn, DBusMessage *msg) {
+    static StatEntry entries[STATS_MAX];
+    DBusMessageIter iter, array, entry;
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    int count = MIN(stats_collect(entries, STATS_MAX), STATS_MAX);
+
+    if (!reply)
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sd}", &array);
+    for (int i = 0; i < count; i++) {
+        const char *name = entries[i].name;
+
+        dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_DOUBLE, &entries[i].value);
+        dbus_message_iter_close_container(&array, &entry);
+    }
+    dbus_message_iter_close_container(&iter, &array);
+
+    send_message(reply);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 static DBusHandlerResult
 handle_message(DBusConnection *conn, DBusMessage *msg, void *user_data) {
-    printf("Received D-Bus message\n");  // Debug print
+    log_debug("Received D-Bus message\n");
 
     if (dbus_message_is_method_call(msg, "org.freedesktop.DBus.Introspectable", "Introspect")) {
-        printf("Handling Introspect request\n");  // Debug print
+        log_debug("Handling Introspect request\n");
         DBusMessage *reply = dbus_message_new_method_return(msg);
         if (!reply) {
             return DBUS_HANDLER_RESULT_NEED_MEMORY;
@@ -186,30 +616,35 @@ handle_message(DBusConnection *conn, DBusMessage *msg, void *user_data) {
                                DBUS_TYPE_STRING, &introspection_xml,
                                DBUS_TYPE_INVALID);
 
-        dbus_connection_send(conn, reply, NULL);
-        dbus_connection_flush(conn);
+        send_message(reply);
         dbus_message_unref(reply);
         return DBUS_HANDLER_RESULT_HANDLED;
     }
 
     if (dbus_message_is_method_call(msg, SNOT_DBUS_INTERFACE, "GetServerInformation")) {
-        printf("Handling GetServerInformation request\n");  // Debug print
+        log_debug("Handling GetServerInformation request\n");
         return method_get_server_information(conn, msg);
     }
 
     if (dbus_message_is_method_call(msg, SNOT_DBUS_INTERFACE, "GetCapabilities")) {
-        printf("Handling GetCapabilities request\n");  // Debug print
+        log_debug("Handling GetCapabilities request\n");
         return method_get_capabilities(conn, msg);
     }
 
     if (dbus_message_is_method_call(msg, SNOT_DBUS_INTERFACE, "Notify")) {
-        printf("Handling Notify request\n");  // Debug print
-        DBusHandlerResult result = handle_notification_method(conn, msg);
-        dbus_connection_flush(conn);
-        return result;
+        log_debug("Handling Notify request\n");
+        return handle_notification_method(conn, msg);
     }
 
-    printf("Unhandled D-Bus message\n");  // Debug print
+    if (dbus_message_is_method_call(msg, SNOT_BATCH_INTERFACE, "Batch")) {
+        log_debug("Handling Batch request\n");
+        return handle_batch_method(conn, msg);
+    }
+
+    if (dbus_message_is_method_call(msg, SNOT_STATS_INTERFACE, "GetStats"))
+        return method_get_stats(conn, msg);
+
+    log_debug("Unhandled D-Bus message\n");
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
@@ -232,6 +667,19 @@ dbus_init(void) {
 
     dbus_connection_set_exit_on_disconnect(connection, FALSE);
 
+    if (!dbus_connection_set_watch_functions(connection, add_watch,
+                                            remove_watch, toggle_watch,
+                                            NULL, NULL)) {
+        fprintf(stderr, "Failed to set watch functions\n");
+        return -1;
+    }
+    if (!dbus_connection_set_timeout_functions(connection, add_timeout,
+                                              remove_timeout, toggle_timeout,
+                                              NULL, NULL)) {
+        fprintf(stderr, "Failed to set timeout functions\n");
+        return -1;
+    }
+
     int ret = dbus_bus_request_name(connection, SNOT_DBUS_INTERFACE,
                                   DBUS_NAME_FLAG_REPLACE_EXISTING,
                                   &err);
@@ -251,19 +699,126 @@ dbus_init(void) {
         return -1;
     }
 
-    printf("D-Bus initialized successfully\n");
+    log_info("D-Bus initialized successfully\n");
     return 0;
 }
 
 void
 dbus_destroy(void) {
     if (connection) {
+        bus_flush_held(send_held);
+        if (outbox_len > 0)
+            flush_outbox();
+        dbus_connection_flush(connection);
         dbus_connection_unref(connection);
     }
 }
 
 int
-dbus_dispatch(void) {
-    dbus_connection_read_write_dispatch(connection, 0);
+dbus_prepare(fd_set *read_fds, fd_set *write_fds) {
+    int maxfd = -1;
+    bool want_write = outbox_len > 0 ||
+                      dbus_connection_has_messages_to_send(connection);
+
+    for (int i = 0; i < watch_count; i++) {
+        DBusWatch *w = watches[i];
+        if (!dbus_watch_get_enabled(w))
+            continue;
+
+        int fd = dbus_watch_get_unix_fd(w);
+        unsigned int flags = dbus_watch_get_flags(w);
+
+        if (flags & DBUS_WATCH_READABLE)
+            FD_SET(fd, read_fds);
+        if (want_write && (flags & DBUS_WATCH_WRITABLE))
+            FD_SET(fd, write_fds);
+        maxfd = MAX(maxfd, fd);
+    }
+
+    return maxfd;
+}
+
+int
+dbus_dispatch(fd_set *read_fds, fd_set *write_fds) {
+    bool writable = false;
+
+    for (int i = 0; i < watch_count; i++) {
+        DBusWatch *w = watches[i];
+        if (!dbus_watch_get_enabled(w))
+            continue;
+
+        int fd = dbus_watch_get_unix_fd(w);
+        unsigned int flags = dbus_watch_get_flags(w);
+
+        if ((flags & DBUS_WATCH_READABLE) && FD_ISSET(fd, read_fds))
+            dbus_watch_handle(w, DBUS_WATCH_READABLE);
+        if ((flags & DBUS_WATCH_WRITABLE) && FD_ISSET(fd, write_fds))
+            writable = true;
+    }
+    handle_timeouts();
+
+    while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+
+    /* everything queued by the previous pass goes out in one go; whatever
+     * libdbus could not write without blocking stays on its own queue and
+     * is pushed by the writable watch on a later pass */
+    if (writable) {
+        if (outbox_len > 0)
+            flush_outbox();
+        for (int i = 0; i < watch_count; i++) {
+            DBusWatch *w = watches[i];
+            if (dbus_watch_get_enabled(w) &&
+                (dbus_watch_get_flags(w) & DBUS_WATCH_WRITABLE) &&
+                FD_ISSET(dbus_watch_get_unix_fd(w), write_fds))
+                dbus_watch_handle(w, DBUS_WATCH_WRITABLE);
+        }
+    }
+
     return 0;
-}
\ No newline at end of file
+}
+
+const DBusFlushStats *
+dbus_get_flush_stats(void) {
+    return &flush_stats;
+}
+
+void
+dbus_emit_closed(uint32_t id, uint32_t reason) {
+    DBusMessage *signal = dbus_message_new_signal(SNOT_DBUS_PATH,
+                                                  SNOT_DBUS_INTERFACE,
+                                                  "NotificationClosed");
+    if (!signal)
+        return;
+
+    dbus_message_append_args(signal,
+                           DBUS_TYPE_UINT32, &id,
+                           DBUS_TYPE_UINT32, &reason,
+                           DBUS_TYPE_INVALID);
+    send_message(signal);
+    dbus_message_unref(signal);
+}
+
+long
+dbus_release_replies(void) {
+    return bus_release_replies(send_held);
+}
+
+/* ms until libdbus wants a timeout handled, -1 if none is armed */
+long
+dbus_next_timeout(void) {
+    unsigned long now = latency_now_ms();
+    long next = -1;
+
+    for (int i = 0; i < timeout_count; i++) {
+        if (!dbus_timeout_get_enabled(timeouts[i].timeout))
+            continue;
+        long left = (long)(timeouts[i].due - now);
+        if (left < 0)
+            left = 0;
+        if (next < 0 || left < next)
+            next = left;
+    }
+    return next;
+}
+
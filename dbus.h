@@ -1,15 +1,64 @@
-#ifndef DBUS_H
-#define DBUS_H
+#ifndef SNOT_DBUS_H
+#define SNOT_DBUS_H
 
 #include <stdint.h>
-#include <dbus/dbus.h>
+#include <stdbool.h>
+#include <sys/select.h>
+
+/*
+ * The notification service as snot.c sees it. It is implemented by
+ * dbus.c on top of libdbus or by sdbus.c on top of sd-bus, picked with
+ * BUS in config.mk; both share bus.c.
+ */
 
 #define SNOT_DBUS_INTERFACE "org.freedesktop.Notifications"
 #define SNOT_DBUS_PATH "/org/freedesktop/Notifications"
+#define SNOT_BATCH_INTERFACE "org.snot.Notify"
+#define SNOT_STATS_INTERFACE "org.snot.Stats"
+
+#define MAX_WATCHES 8
+#define MAX_TIMEOUTS 32              /* pending call timeouts, one per pid lookup in flight */
+#define OUTBOX_SIZE 64
+#define PID_CACHE_SIZE 64
+#define HELD_MAX 256
+#define BATCH_MAX 1024              /* most notifications one Batch call may carry */
+
+typedef struct {
+    unsigned long flushes;          /* outbox flushes performed */
+    unsigned long messages;         /* messages sent over all flushes */
+    unsigned long max_messages;     /* largest single flush */
+    unsigned long last_messages;
+} DBusFlushStats;
+
+typedef struct {
+    unsigned long held;             /* replies deferred by backpressure */
+    unsigned long timed_out;        /* released by REPLY_HOLD_MAX, not by draining */
+    unsigned long unheld;           /* sent at once because HELD_MAX were out */
+    unsigned int outstanding;
+} DBusHoldStats;
+
+typedef struct {
+    unsigned long batches;
+    unsigned long notifications;    /* inserted through Batch */
+} DBusBatchStats;
+
+/* NotificationClosed reasons */
+enum {
+    CLOSE_EXPIRED = 1,
+    CLOSE_DISMISSED,
+    CLOSE_REQUESTED,
+    CLOSE_UNDEFINED,
+};
 
-int dbus_get_fd(void);
 int dbus_init(void);
 void dbus_destroy(void);
-int dbus_dispatch(void);
+int dbus_prepare(fd_set *read_fds, fd_set *write_fds);
+int dbus_dispatch(fd_set *read_fds, fd_set *write_fds);
+const DBusFlushStats *dbus_get_flush_stats(void);
+void dbus_emit_closed(uint32_t id, uint32_t reason);
+long dbus_release_replies(void);
+long dbus_next_timeout(void);
+const DBusHoldStats *dbus_get_hold_stats(void);
+const DBusBatchStats *dbus_get_batch_stats(void);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,543 @@
+/*
+ * fakecomp - a headless Wayland compositor for testing snot
+ *
+ * usage: fakecomp [-S socket] [-c ms] [-r hz] [-d dir] [-s file]
+ *
+ * Implements wl_compositor, wl_shm and zwlr_layer_shell_v1 as far as
+ * snot uses them and draws nothing. Layer surfaces are configured to
+ * the size they ask for, -c ms after their commit. Buffers are released
+ * as soon as they are committed, and with -d written to dir as PNG
+ * first. Frame callbacks fire at -r hz (60), or right away with -r 0.
+ *
+ * The socket name, from -S or picked freely, is printed to stdout as
+ * WAYLAND_DISPLAY=name once clients can connect. On SIGUSR1 and on
+ * exit (SIGINT, SIGTERM) the number of each request and event seen is
+ * written to stderr, or to file with -s.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cairo/cairo.h>
+#include <wayland-server.h>
+#include "protocols/wlr-layer-shell-unstable-v1-server-protocol.h"
+#include "latency.h"
+
+#define OUTPUT_WIDTH 1920       /* what a size of 0 is configured to */
+#define OUTPUT_HEIGHT 1080
+#define MAX_COUNTS 128
+
+typedef struct LayerSurface LayerSurface;
+
+typedef struct {
+    struct wl_resource *resource;
+    struct wl_resource *buffer;     /* attached, not yet committed */
+    struct wl_listener buffer_destroy;
+    struct wl_list frames;          /* callbacks waiting for a commit */
+    LayerSurface *layer;
+    unsigned int number;            /* for PNG names */
+    unsigned long commits;
+} Surface;
+
+struct LayerSurface {
+    struct wl_resource *resource;
+    Surface *surface;
+    struct wl_event_source *timer;  /* delayed configure */
+    uint32_t width, height;         /* as last requested */
+    bool committed;                 /* initial commit seen */
+    bool resized;                   /* set_size since the last configure */
+};
+
+static struct wl_display *display;
+static struct wl_event_loop *loop;
+static struct wl_event_source *frame_timer;
+static struct wl_list frame_queue;  /* committed callbacks due next tick */
+static unsigned int surface_count;
+static uint32_t serial;
+
+static int configure_delay = 0;
+static int refresh = 60;
+static const char *png_dir;
+static const char *stats_file;
+
+static struct {
+    const struct wl_message *message;
+    const char *interface;
+    bool event;
+    unsigned long count;
+} counts[MAX_COUNTS];
+static int count_len;
+
+static void
+die(const char *msg) {
+    fprintf(stderr, "fakecomp: %s\n", msg);
+    exit(1);
+}
+
+static void
+protocol_logger(void *data, enum wl_protocol_logger_type type,
+                const struct wl_protocol_logger_message *m) {
+    bool event = type == WL_PROTOCOL_LOGGER_EVENT;
+    int i;
+
+    for (i = 0; i < count_len; i++)
+        if (counts[i].message == m->message && counts[i].event == event)
+            break;
+    if (i == count_len) {
+        if (count_len == MAX_COUNTS)
+            return;
+        counts[i].message = m->message;
+        counts[i].interface = wl_resource_get_class(m->resource);
+        counts[i].event = event;
+        count_len++;
+    }
+    counts[i].count++;
+}
+
+static void
+dump_counts(void) {
+    FILE *f = stats_file ? fopen(stats_file, "w") : stderr;
+
+    if (!f) {
+        perror(stats_file);
+        return;
+    }
+    for (int i = 0; i < count_len; i++)
+        fprintf(f, "%s %s.%s %lu\n", counts[i].event ? "event" : "request",
+                counts[i].interface, counts[i].message->name, counts[i].count);
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+}
+
+/* frame callbacks */
+
+static void
+callback_destroy(struct wl_resource *resource) {
+    wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+fire_frames(void) {
+    struct wl_resource *cb, *tmp;
+    uint32_t time = latency_now_ms();
+
+    wl_resource_for_each_safe(cb, tmp, &frame_queue) {
+        wl_callback_send_done(cb, time);
+        wl_resource_destroy(cb);
+    }
+}
+
+static int
+frame_tick(void *data) {
+    fire_frames();
+    wl_event_source_timer_update(frame_timer, 1000 / refresh);
+    return 0;
+}
+
+/* layer surfaces */
+
+static void
+send_configure(LayerSurface *l) {
+    zwlr_layer_surface_v1_send_configure(l->resource, ++serial,
+                                         l->width ? l->width : OUTPUT_WIDTH,
+                                         l->height ? l->height : OUTPUT_HEIGHT);
+    l->resized = false;
+}
+
+static int
+configure_timeout(void *data) {
+    send_configure(data);
+    return 0;
+}
+
+static void
+schedule_configure(LayerSurface *l) {
+    if (configure_delay > 0)
+        wl_event_source_timer_update(l->timer, configure_delay);
+    else
+        send_configure(l);
+}
+
+static void
+layer_commit(LayerSurface *l) {
+    if (!l->committed) {
+        l->committed = true;
+        schedule_configure(l);
+    } else if (l->resized) {
+        schedule_configure(l);
+    }
+}
+
+static void
+layer_set_size(struct wl_client *client, struct wl_resource *resource,
+               uint32_t width, uint32_t height) {
+    LayerSurface *l = wl_resource_get_user_data(resource);
+
+    if (width != l->width || height != l->height)
+        l->resized = true;
+    l->width = width;
+    l->height = height;
+}
+
+static void
+layer_set_anchor(struct wl_client *client, struct wl_resource *resource,
+                 uint32_t anchor) {
+}
+
+static void
+layer_set_exclusive_zone(struct wl_client *client, struct wl_resource *resource,
+                         int32_t zone) {
+}
+
+static void
+layer_set_margin(struct wl_client *client, struct wl_resource *resource,
+                 int32_t top, int32_t right, int32_t bottom, int32_t left) {
+}
+
+static void
+layer_set_keyboard_interactivity(struct wl_client *client,
+                                 struct wl_resource *resource, uint32_t ki) {
+}
+
+static void
+layer_get_popup(struct wl_client *client, struct wl_resource *resource,
+                struct wl_resource *popup) {
+}
+
+static void
+layer_ack_configure(struct wl_client *client, struct wl_resource *resource,
+                    uint32_t serial) {
+}
+
+static void
+layer_set_layer(struct wl_client *client, struct wl_resource *resource,
+                uint32_t layer) {
+}
+
+static void
+layer_set_exclusive_edge(struct wl_client *client, struct wl_resource *resource,
+                         uint32_t edge) {
+}
+
+static void
+resource_destroy(struct wl_client *client, struct wl_resource *resource) {
+    wl_resource_destroy(resource);
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
+    .set_size = layer_set_size,
+    .set_anchor = layer_set_anchor,
+    .set_exclusive_zone = layer_set_exclusive_zone,
+    .set_margin = layer_set_margin,
+    .set_keyboard_interactivity = layer_set_keyboard_interactivity,
+    .get_popup = layer_get_popup,
+    .ack_configure = layer_ack_configure,
+    .destroy = resource_destroy,
+    .set_layer = layer_set_layer,
+    .set_exclusive_edge = layer_set_exclusive_edge,
+};
+
+static void
+layer_surface_free(struct wl_resource *resource) {
+    LayerSurface *l = wl_resource_get_user_data(resource);
+
+    if (l->surface)
+        l->surface->layer = NULL;
+    wl_event_source_remove(l->timer);
+    free(l);
+}
+
+static void
+layer_shell_get_layer_surface(struct wl_client *client,
+                              struct wl_resource *resource, uint32_t id,
+                              struct wl_resource *surface,
+                              struct wl_resource *output, uint32_t layer,
+                              const char *namespace) {
+    LayerSurface *l = calloc(1, sizeof(*l));
+
+    if (!l) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    l->resource = wl_resource_create(client, &zwlr_layer_surface_v1_interface,
+                                     wl_resource_get_version(resource), id);
+    if (!l->resource) {
+        free(l);
+        wl_client_post_no_memory(client);
+        return;
+    }
+    l->surface = wl_resource_get_user_data(surface);
+    l->surface->layer = l;
+    l->timer = wl_event_loop_add_timer(loop, configure_timeout, l);
+    wl_resource_set_implementation(l->resource, &layer_surface_impl, l,
+                                   layer_surface_free);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+    .get_layer_surface = layer_shell_get_layer_surface,
+    .destroy = resource_destroy,
+};
+
+static void
+bind_layer_shell(struct wl_client *client, void *data, uint32_t version,
+                 uint32_t id) {
+    struct wl_resource *r = wl_resource_create(client,
+                                &zwlr_layer_shell_v1_interface, version, id);
+    if (!r) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(r, &layer_shell_impl, NULL, NULL);
+}
+
+/* surfaces */
+
+static void
+write_png(Surface *s, struct wl_shm_buffer *shm) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/surface-%u-%06lu.png",
+             png_dir, s->number, s->commits);
+    wl_shm_buffer_begin_access(shm);
+    cairo_surface_t *img = cairo_image_surface_create_for_data(
+        wl_shm_buffer_get_data(shm), CAIRO_FORMAT_ARGB32,
+        wl_shm_buffer_get_width(shm), wl_shm_buffer_get_height(shm),
+        wl_shm_buffer_get_stride(shm));
+    if (cairo_surface_write_to_png(img, path) != CAIRO_STATUS_SUCCESS)
+        fprintf(stderr, "fakecomp: cannot write %s\n", path);
+    cairo_surface_destroy(img);
+    wl_shm_buffer_end_access(shm);
+}
+
+static void
+buffer_destroyed(struct wl_listener *listener, void *data) {
+    Surface *s = wl_container_of(listener, s, buffer_destroy);
+
+    wl_list_remove(&s->buffer_destroy.link);
+    s->buffer = NULL;
+}
+
+static void
+surface_attach(struct wl_client *client, struct wl_resource *resource,
+               struct wl_resource *buffer, int32_t x, int32_t y) {
+    Surface *s = wl_resource_get_user_data(resource);
+
+    if (s->buffer)
+        wl_list_remove(&s->buffer_destroy.link);
+    s->buffer = buffer;
+    if (buffer)
+        wl_resource_add_destroy_listener(buffer, &s->buffer_destroy);
+}
+
+static void
+surface_damage(struct wl_client *client, struct wl_resource *resource,
+               int32_t x, int32_t y, int32_t width, int32_t height) {
+}
+
+static void
+surface_frame(struct wl_client *client, struct wl_resource *resource,
+              uint32_t callback) {
+    Surface *s = wl_resource_get_user_data(resource);
+    struct wl_resource *cb = wl_resource_create(client, &wl_callback_interface,
+                                                1, callback);
+    if (!cb) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(cb, NULL, NULL, callback_destroy);
+    wl_list_insert(s->frames.prev, wl_resource_get_link(cb));
+}
+
+static void
+surface_set_region(struct wl_client *client, struct wl_resource *resource,
+                   struct wl_resource *region) {
+}
+
+/* the buffer is "shown" and given back at once */
+static void
+surface_commit(struct wl_client *client, struct wl_resource *resource) {
+    Surface *s = wl_resource_get_user_data(resource);
+
+    s->commits++;
+    if (s->buffer) {
+        struct wl_shm_buffer *shm = wl_shm_buffer_get(s->buffer);
+        if (shm && png_dir)
+            write_png(s, shm);
+        wl_buffer_send_release(s->buffer);
+        wl_list_remove(&s->buffer_destroy.link);
+        s->buffer = NULL;
+    }
+
+    wl_list_insert_list(frame_queue.prev, &s->frames);
+    wl_list_init(&s->frames);
+    if (!refresh)
+        fire_frames();
+
+    if (s->layer)
+        layer_commit(s->layer);
+}
+
+static void
+surface_set_int(struct wl_client *client, struct wl_resource *resource,
+                int32_t value) {
+}
+
+static const struct wl_surface_interface surface_impl = {
+    .destroy = resource_destroy,
+    .attach = surface_attach,
+    .damage = surface_damage,
+    .frame = surface_frame,
+    .set_opaque_region = surface_set_region,
+    .set_input_region = surface_set_region,
+    .commit = surface_commit,
+    .set_buffer_transform = surface_set_int,
+    .set_buffer_scale = surface_set_int,
+    .damage_buffer = surface_damage,
+};
+
+static void
+surface_free(struct wl_resource *resource) {
+    Surface *s = wl_resource_get_user_data(resource);
+    struct wl_resource *cb, *tmp;
+
+    wl_resource_for_each_safe(cb, tmp, &s->frames)
+        wl_resource_destroy(cb);
+    if (s->buffer)
+        wl_list_remove(&s->buffer_destroy.link);
+    if (s->layer)
+        s->layer->surface = NULL;
+    free(s);
+}
+
+static void
+compositor_create_surface(struct wl_client *client, struct wl_resource *resource,
+                          uint32_t id) {
+    Surface *s = calloc(1, sizeof(*s));
+
+    if (!s) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    s->resource = wl_resource_create(client, &wl_surface_interface,
+                                     wl_resource_get_version(resource), id);
+    if (!s->resource) {
+        free(s);
+        wl_client_post_no_memory(client);
+        return;
+    }
+    s->number = surface_count++;
+    s->buffer_destroy.notify = buffer_destroyed;
+    wl_list_init(&s->frames);
+    wl_resource_set_implementation(s->resource, &surface_impl, s, surface_free);
+}
+
+static void
+region_op(struct wl_client *client, struct wl_resource *resource,
+          int32_t x, int32_t y, int32_t width, int32_t height) {
+}
+
+static const struct wl_region_interface region_impl = {
+    .destroy = resource_destroy,
+    .add = region_op,
+    .subtract = region_op,
+};
+
+static void
+compositor_create_region(struct wl_client *client, struct wl_resource *resource,
+                         uint32_t id) {
+    struct wl_resource *r = wl_resource_create(client, &wl_region_interface,
+                                               1, id);
+    if (!r) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(r, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+    .create_surface = compositor_create_surface,
+    .create_region = compositor_create_region,
+};
+
+static void
+bind_compositor(struct wl_client *client, void *data, uint32_t version,
+                uint32_t id) {
+    struct wl_resource *r = wl_resource_create(client, &wl_compositor_interface,
+                                               version, id);
+    if (!r) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(r, &compositor_impl, NULL, NULL);
+}
+
+static int
+handle_signal(int sig, void *data) {
+    if (sig == SIGUSR1)
+        dump_counts();
+    else
+        wl_display_terminate(display);
+    return 0;
+}
+
+static void
+usage(void) {
+    die("usage: fakecomp [-S socket] [-c ms] [-r hz] [-d dir] [-s file]");
+}
+
+int
+main(int argc, char *argv[]) {
+    const char *socket = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:c:r:d:s:")) != -1) {
+        switch (opt) {
+        case 'S': socket = optarg; break;
+        case 'c': configure_delay = atoi(optarg); break;
+        case 'r': refresh = atoi(optarg); break;
+        case 'd': png_dir = optarg; break;
+        case 's': stats_file = optarg; break;
+        default: usage();
+        }
+    }
+    if (refresh < 0 || configure_delay < 0)
+        usage();
+
+    if (!(display = wl_display_create()))
+        die("cannot create display");
+    loop = wl_display_get_event_loop(display);
+    wl_list_init(&frame_queue);
+
+    if (wl_display_init_shm(display) < 0 ||
+        !wl_global_create(display, &wl_compositor_interface, 4, NULL,
+                          bind_compositor) ||
+        !wl_global_create(display, &zwlr_layer_shell_v1_interface, 1, NULL,
+                          bind_layer_shell))
+        die("cannot create globals");
+    wl_display_add_protocol_logger(display, protocol_logger, NULL);
+
+    if (socket ? wl_display_add_socket(display, socket) < 0
+               : !(socket = wl_display_add_socket_auto(display)))
+        die("cannot open socket, is XDG_RUNTIME_DIR set?");
+
+    wl_event_loop_add_signal(loop, SIGINT, handle_signal, NULL);
+    wl_event_loop_add_signal(loop, SIGTERM, handle_signal, NULL);
+    wl_event_loop_add_signal(loop, SIGUSR1, handle_signal, NULL);
+    if (refresh) {
+        frame_timer = wl_event_loop_add_timer(loop, frame_tick, NULL);
+        wl_event_source_timer_update(frame_timer, 1000 / refresh);
+    }
+
+    printf("WAYLAND_DISPLAY=%s\n", socket);
+    fflush(stdout);
+    wl_display_run(display);
+
+    dump_counts();
+    wl_display_destroy_clients(display);
+    wl_display_destroy(display);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs a command with no desktop: its own XDG_RUNTIME_DIR, a private
+# session bus and fakecomp for a compositor. Extra fakecomp options can
+# be given in FAKECOMP_FLAGS.
+#
+# usage: ./headless.sh command [args...]
+
+dir=$(mktemp -d) || exit 2
+export XDG_RUNTIME_DIR="$dir"
+export WAYLAND_DISPLAY=wayland-snot
+
+./fakecomp -S "$WAYLAND_DISPLAY" $FAKECOMP_FLAGS >/dev/null &
+comp=$!
+trap 'kill $comp 2>/dev/null; wait $comp; rm -rf "$dir"' EXIT INT TERM
+
+tries=0
+until [ -S "$dir/$WAYLAND_DISPLAY" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 100 ] || ! kill -0 $comp 2>/dev/null; then
+        echo "headless.sh: fakecomp did not start" >&2
+        exit 2
+    fi
+    sleep 0.05
+done
+
+dbus-run-session -- "$@"
@@ -0,0 +1,47 @@
+#include <string.h>
+#include "hints.h"
+
+/* perfect hash over the hints we understand, see hint_hash() */
+static const struct {
+    const char *key;
+    int id;
+} hint_table[32] = {
+    [1]  = { "urgency",                         HINT_URGENCY },
+    [4]  = { "image_path",                      HINT_IMAGE_PATH },
+    [7]  = { "desktop-entry",                   HINT_DESKTOP_ENTRY },
+    [11] = { "image-data",                      HINT_IMAGE_DATA },
+    [13] = { "transient",                       HINT_TRANSIENT },
+    [17] = { "value",                           HINT_VALUE },
+    [18] = { "image-path",                      HINT_IMAGE_PATH },
+    [19] = { "category",                        HINT_CATEGORY },
+    [20] = { "x-dunst-stack-tag",               HINT_STACK_TAG },
+    [26] = { "resident",                        HINT_RESIDENT },
+    [27] = { "icon_data",                       HINT_ICON_DATA },
+    [29] = { "image_data",                      HINT_IMAGE_DATA },
+    [31] = { "x-canonical-private-synchronous", HINT_STACK_TAG },
+};
+
+static unsigned int
+hint_hash(const unsigned char *s, size_t len) {
+    return (len * 2 + s[0] + s[len - 1] + s[len / 2]) & 31;
+}
+
+void
+hints_init(Hints *h) {
+    memset(h, 0, sizeof(*h));
+    h->urgency = URGENCY_NORMAL;
+    h->value = -1;
+    h->image_data.key = HINT_UNKNOWN;
+}
+
+int
+hint_lookup(const char *key) {
+    size_t len = strlen(key);
+    if (len == 0)
+        return HINT_UNKNOWN;
+
+    unsigned int slot = hint_hash((const unsigned char *)key, len);
+    if (!hint_table[slot].key || strcmp(hint_table[slot].key, key) != 0)
+        return HINT_UNKNOWN;
+    return hint_table[slot].id;
+}
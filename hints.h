@@ -0,0 +1,67 @@
+#ifndef HINTS_H
+#define HINTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "image.h"
+#ifdef BUS_SDBUS
+#include <systemd/sd-bus.h>
+#else
+#include <dbus/dbus.h>
+#endif
+
+enum {
+    URGENCY_LOW,
+    URGENCY_NORMAL,
+    URGENCY_CRITICAL,
+};
+
+enum {
+    HINT_UNKNOWN = -1,
+    HINT_URGENCY,
+    HINT_CATEGORY,
+    HINT_VALUE,
+    HINT_IMAGE_DATA,
+    HINT_IMAGE_PATH,
+    HINT_ICON_DATA,
+    HINT_DESKTOP_ENTRY,
+    HINT_TRANSIENT,
+    HINT_RESIDENT,
+    HINT_STACK_TAG,
+};
+
+/* a hint value left inside its message; the message is only referenced
+ * once something keeps the value past the handler */
+typedef struct {
+#ifdef BUS_SDBUS
+    sd_bus_message *msg;
+    ImageData img;          /* pixels point into msg */
+#else
+    DBusMessage *msg;
+    DBusMessageIter iter;   /* positioned at the variant contents */
+#endif
+    int key;                /* HINT_IMAGE_DATA or HINT_ICON_DATA */
+} LazyHint;
+
+/* strings are borrowed from the message and only valid while it is */
+typedef struct {
+    uint8_t urgency;
+    int32_t value;          /* progress 0-100, -1 if unset */
+    const char *category;
+    const char *image_path;
+    const char *desktop_entry;
+    const char *stack_tag;
+    bool transient;
+    bool resident;
+    LazyHint image_data;
+} Hints;
+
+void hints_init(Hints *h);
+int hint_lookup(const char *key);
+
+/* provided by the bus backend, dbus.c or sdbus.c */
+void lazy_hint_retain(LazyHint *dst, const LazyHint *src);
+void lazy_hint_release(LazyHint *h);
+int hint_get_image(const LazyHint *h, ImageData *img);
+
+#endif
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "icon.h"
+#include "icontheme.h"
+#include "snot.h"
+#include "probes.h"
+#include "config.h"
+
+#define ICON_BUCKETS 256
+
+/*
+ * Decoded icons, already scaled to the box they are drawn into. Entries
+ * live in a hash table for lookup and on an LRU list for eviction once
+ * ICON_CACHE_BUDGET bytes of surfaces are held. Failed loads are cached
+ * too (surface == NULL) so a missing icon is not retried every time.
+ */
+typedef struct IconEntry {
+    struct IconEntry *next;         /* hash chain */
+    struct IconEntry *lru_prev, *lru_next;
+    uint32_t hash;
+    char *key;
+    char *path;                     /* resolved file, NULL if none */
+    int size, scale;
+    struct timespec mtime;
+    time_t checked;                 /* last time mtime was compared */
+    bool exists;                    /* the file was there when loaded */
+    cairo_surface_t *surface;
+    size_t bytes;
+    bool pending;                   /* queued on the decode worker */
+    bool deferred;                  /* pending, but the queue was full */
+} IconEntry;
+
+/* Theme lookups, PNG decoding and scaling happen on a worker thread;
+ * results come back through a pipe the main loop selects on */
+typedef struct {
+    char *key, *path;               /* path NULL: look key up in the theme */
+    int size, scale;
+    struct timespec mtime;
+    bool exists;
+    cairo_surface_t *surface;
+} IconJob;
+
+static IconEntry *buckets[ICON_BUCKETS];
+static IconEntry *lru_head, *lru_tail;     /* head is most recent */
+static IconCacheStats stats;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static IconJob jobs[ICON_DECODE_QUEUE], done[ICON_DECODE_QUEUE];
+static int job_head, job_count, done_head, done_count;
+static int inflight;                /* submitted, not yet dispatched */
+static int deferred;                /* entries waiting for a queue slot */
+static int wake_pipe[2] = { -1, -1 };
+
+static uint32_t
+icon_hash(const char *key, int size, int scale) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    h = (h ^ (uint32_t)size) * 16777619u;
+    h = (h ^ (uint32_t)scale) * 16777619u;
+    return h;
+}
+
+static void
+lru_unlink(IconEntry *e) {
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lru_push(IconEntry *e) {
+    e->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = e;
+    lru_head = e;
+    if (!lru_tail)
+        lru_tail = e;
+}
+
+static void
+entry_free(IconEntry *e) {
+    IconEntry **pp = &buckets[e->hash % ICON_BUCKETS];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+
+    lru_unlink(e);
+    stats.bytes -= e->bytes;
+    if (e->surface)
+        cairo_surface_destroy(e->surface);
+    free(e->key);
+    free(e->path);
+    free(e);
+}
+
+/* %XX escapes of a file:// URI, NULL if it does not fit or holds a NUL */
+static const char *
+uri_decode(const char *s, char *out, size_t size) {
+    size_t n = 0;
+
+    for (; *s; s++) {
+        if (n + 1 >= size)
+            return NULL;
+        if (s[0] == '%' && isxdigit((unsigned char)s[1]) &&
+            isxdigit((unsigned char)s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            if (!(out[n++] = strtol(hex, NULL, 16)))
+                return NULL;
+            s += 2;
+        } else {
+            out[n++] = *s;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+/* file:// URIs and plain paths; anything else is a theme icon name
+ * resolved through the icon theme index on the worker */
+static bool
+is_file(const char *icon) {
+    return strncmp(icon, "file://", 7) == 0 || icon[0] == '/';
+}
+
+static const char *
+icon_path(const char *icon) {
+    static char path[PATH_MAX];
+
+    if (strncmp(icon, "file://", 7) == 0)
+        return uri_decode(icon + 7, path, sizeof(path));
+    return icon;
+}
+
+static cairo_surface_t *
+load_scaled(const char *path, int px) {
+    cairo_surface_t *src = cairo_image_surface_create_from_png(path);
+    if (cairo_surface_status(src) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(src);
+        return NULL;
+    }
+
+    int w = cairo_image_surface_get_width(src);
+    int h = cairo_image_surface_get_height(src);
+    if (w == px && h == px)
+        return src;
+
+    cairo_surface_t *dst = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, px, px);
+    if (cairo_surface_status(dst) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(dst);
+        cairo_surface_destroy(src);
+        return NULL;
+    }
+
+    /* fit, keep aspect, center */
+    double s = MIN((double)px / w, (double)px / h);
+    cairo_t *cr = cairo_create(dst);
+    cairo_translate(cr, (px - w * s) / 2, (px - h * s) / 2);
+    cairo_scale(cr, s, s);
+    cairo_set_source_surface(cr, src, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(src);
+
+    return dst;
+}
+
+static void
+evict(void) {
+    IconEntry *e = lru_tail;
+    while (stats.bytes > ICON_CACHE_BUDGET && e) {
+        IconEntry *prev = e->lru_prev;
+        if (!e->pending) {
+            entry_free(e);
+            stats.evictions++;
+        }
+        e = prev;
+    }
+}
+
+static IconEntry *
+find_entry(uint32_t hash, const char *icon, int size, int scale) {
+    for (IconEntry *e = buckets[hash % ICON_BUCKETS]; e; e = e->next) {
+        if (e->hash == hash && e->size == size && e->scale == scale &&
+            strcmp(e->key, icon) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static IconEntry *
+new_entry(uint32_t hash, const char *icon, int size, int scale) {
+    IconEntry *e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->key = strdup(icon);
+    if (!e->key) {
+        free(e);
+        return NULL;
+    }
+    e->hash = hash;
+    e->size = size;
+    e->scale = scale;
+    e->next = buckets[hash % ICON_BUCKETS];
+    buckets[hash % ICON_BUCKETS] = e;
+    lru_push(e);
+    return e;
+}
+
+/* ---- decode worker ---- */
+
+static int
+submit(const char *icon, const char *path, int size, int scale) {
+    if (inflight >= ICON_DECODE_QUEUE)
+        return -1;
+
+    IconJob job = {
+        .key = strdup(icon),
+        .path = path ? strdup(path) : NULL,
+        .size = size,
+        .scale = scale,
+    };
+    if (!job.key || (path && !job.path)) {
+        free(job.key);
+        free(job.path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    jobs[(job_head + job_count++) % ICON_DECODE_QUEUE] = job;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    inflight++;
+    return 0;
+}
+
+/* queues what a full queue turned away, oldest first */
+static void
+submit_deferred(void) {
+    for (IconEntry *e = lru_tail; e && deferred && inflight < ICON_DECODE_QUEUE;
+         e = e->lru_prev) {
+        if (!e->deferred || submit(e->key, e->path, e->size, e->scale) < 0)
+            continue;
+        e->deferred = false;
+        deferred--;
+    }
+}
+
+static void *
+worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (job_count == 0)
+            pthread_cond_wait(&cond, &lock);
+        IconJob job = jobs[job_head];
+        job_head = (job_head + 1) % ICON_DECODE_QUEUE;
+        job_count--;
+        pthread_mutex_unlock(&lock);
+
+        if (!job.path) {
+            const char *found = icon_theme_lookup(job.key, job.size * job.scale);
+            job.path = found ? strdup(found) : NULL;
+        }
+
+        struct stat st;
+        if (job.path && stat(job.path, &st) == 0) {
+            job.exists = true;
+            job.mtime = st.st_mtim;
+            job.surface = load_scaled(job.path, job.size * job.scale);
+        }
+
+        pthread_mutex_lock(&lock);
+        done[(done_head + done_count++) % ICON_DECODE_QUEUE] = job;
+        pthread_mutex_unlock(&lock);
+
+        while (write(wake_pipe[1], "", 1) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+int
+icon_cache_init(void) {
+    pthread_t thread;
+
+    if (pipe(wake_pipe) < 0)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int
+icon_cache_get_fd(void) {
+    return wake_pipe[0];
+}
+
+void
+icon_cache_dispatch(void) {
+    IconJob ready[ICON_DECODE_QUEUE];
+    char drain[64];
+    int count = 0;
+
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&lock);
+    while (done_count > 0) {
+        ready[count++] = done[done_head];
+        done_head = (done_head + 1) % ICON_DECODE_QUEUE;
+        done_count--;
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < count; i++) {
+        IconJob *job = &ready[i];
+        uint32_t hash = icon_hash(job->key, job->size, job->scale);
+        IconEntry *e = find_entry(hash, job->key, job->size, job->scale);
+
+        inflight--;
+        if (!e)
+            e = new_entry(hash, job->key, job->size, job->scale);
+        if (e) {
+            if (e->surface) {
+                stats.bytes -= e->bytes;
+                cairo_surface_destroy(e->surface);
+            }
+            e->pending = false;
+            e->checked = time(NULL);
+            e->mtime = job->mtime;
+            e->exists = job->exists;
+            free(e->path);
+            e->path = job->path;
+            job->path = NULL;
+            e->surface = job->surface ? cairo_surface_reference(job->surface) : NULL;
+            e->bytes = 0;
+            if (e->surface)
+                e->bytes = (size_t)cairo_image_surface_get_stride(e->surface) *
+                           cairo_image_surface_get_height(e->surface);
+            stats.bytes += e->bytes;
+        }
+
+        icon_loaded(job->key, job->size, job->scale, job->surface);
+
+        if (job->surface)
+            cairo_surface_destroy(job->surface);
+        free(job->key);
+        free(job->path);
+    }
+
+    submit_deferred();
+    evict();
+}
+
+/*
+ * ICON_READY: *surface is a new reference (NULL if the icon failed to
+ * load). ICON_PENDING: decoding was queued, icon_loaded() is called once
+ * it finishes. ICON_NONE: there is nothing to show.
+ */
+int
+icon_cache_get(const char *icon, int size, int scale, cairo_surface_t **surface) {
+    *surface = NULL;
+    if (!icon || !*icon)
+        return ICON_NONE;
+
+    const char *path = NULL;
+    if (is_file(icon) && !(path = icon_path(icon)))
+        return ICON_NONE;
+
+    uint32_t hash = icon_hash(icon, size, scale);
+    IconEntry *e = find_entry(hash, icon, size, scale);
+
+    if (e && e->pending)
+        return ICON_PENDING;
+
+    if (e) {
+        time_t now = time(NULL);
+        struct stat st;
+
+        if (now - e->checked < ICON_CACHE_RECHECK)
+            goto hit;
+        e->checked = now;
+        /* a file that fails to decode stays cached until it changes; a
+         * theme name keeps the file it resolved to, and one that resolved
+         * to nothing is looked up again */
+        bool exists = e->path && stat(e->path, &st) == 0;
+        if ((path || e->path) && exists == e->exists && (!exists ||
+            (st.st_mtim.tv_sec == e->mtime.tv_sec &&
+             st.st_mtim.tv_nsec == e->mtime.tv_nsec)))
+            goto hit;
+        entry_free(e);
+        stats.invalidations++;
+    }
+
+    stats.misses++;
+    PROBE1(cache_miss, icon);
+
+    /* a full queue is not a missing icon: the placeholder is submitted
+     * from icon_cache_dispatch() once a slot frees up */
+    if (inflight >= ICON_DECODE_QUEUE) {
+        if (!(e = new_entry(hash, icon, size, scale)))
+            return ICON_NONE;
+        if (path && !(e->path = strdup(path))) {
+            entry_free(e);
+            return ICON_NONE;
+        }
+        e->pending = e->deferred = true;
+        deferred++;
+        return ICON_PENDING;
+    }
+    if (submit(icon, path, size, scale) < 0)
+        return ICON_NONE;
+
+    /* placeholder so repeats while decoding do not queue the same work */
+    e = new_entry(hash, icon, size, scale);
+    if (e)
+        e->pending = true;
+    return ICON_PENDING;
+
+hit:
+    stats.hits++;
+    PROBE1(cache_hit, icon);
+    lru_unlink(e);
+    lru_push(e);
+    if (e->surface)
+        *surface = cairo_surface_reference(e->surface);
+    return ICON_READY;
+}
+
+const IconCacheStats *
+icon_cache_get_stats(void) {
+    return &stats;
+}
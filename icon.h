@@ -0,0 +1,26 @@
+#ifndef ICON_H
+#define ICON_H
+
+#include <cairo/cairo.h>
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    unsigned long bytes;            /* currently held surface memory */
+} IconCacheStats;
+
+enum {
+    ICON_NONE,
+    ICON_READY,
+    ICON_PENDING,
+};
+
+int icon_cache_init(void);
+int icon_cache_get_fd(void);
+void icon_cache_dispatch(void);
+int icon_cache_get(const char *icon, int size, int scale, cairo_surface_t **surface);
+const IconCacheStats *icon_cache_get_stats(void);
+
+#endif
@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include "icontheme.h"
+#include "config.h"
+
+/*
+ * Named icon lookup. The first lookup resolves ICON_THEME and the themes it
+ * inherits (hicolor last), scans their directories once and builds a
+ * (name -> dir, size) hash index. The index is written to
+ * $XDG_CACHE_HOME/snot/icons-<theme>.idx in the same layout it is used
+ * in, so later runs just mmap it after comparing the recorded directory
+ * and index.theme mtimes. Only .png files are indexed, as cairo is the
+ * only decoder; SVG-only themes resolve nothing. Lookups never touch the
+ * filesystem. They are
+ * made from the icon decode worker only, so building the index never
+ * holds up the main loop.
+ */
+
+#define INDEX_MAGIC "SNOTICN1"
+#define MAX_THEMES 16
+#define MAX_BASES 16
+
+typedef struct {
+    char magic[8];
+    uint32_t n_dirs, n_buckets, n_entries;
+    uint32_t dirs_off, buckets_off, entries_off, strings_off, size;
+} IndexHeader;
+
+/* a scanned directory, or an index.theme only kept for its mtime */
+typedef struct {
+    int64_t mtime_sec;              /* -1: did not exist at build time */
+    int64_t mtime_nsec;
+    uint32_t path;                  /* string offset */
+    int32_t size;                   /* pixel size, 0 unknown, -1 not scanned */
+} IndexDir;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t name;                  /* string offset */
+    uint32_t dir;
+    uint32_t next;                  /* entry index + 1, 0 ends the chain */
+} IndexEntry;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    bool oom;
+} Buf;
+
+static const char *index_data;      /* mmap()ed file or heap buffer */
+static size_t index_len;
+static bool index_tried;
+
+static char *bases[MAX_BASES];
+static int base_count;
+
+static uint32_t
+name_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static uint32_t
+buf_add(Buf *b, const void *p, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data) {
+            b->oom = true;
+            return 0;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    uint32_t off = b->len;
+    memcpy(b->data + off, p, len);
+    b->len += len;
+    return off;
+}
+
+static uint32_t
+buf_str(Buf *b, const char *s) {
+    return buf_add(b, s, strlen(s) + 1);
+}
+
+static void
+add_base(const char *fmt, const char *a, const char *b) {
+    char path[PATH_MAX];
+    if (base_count >= MAX_BASES || !a)
+        return;
+    snprintf(path, sizeof(path), fmt, a, b);
+    bases[base_count++] = strdup(path);
+}
+
+static void
+init_bases(void) {
+    const char *home = getenv("HOME");
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *data_dirs = getenv("XDG_DATA_DIRS");
+
+    add_base("%s/.icons", home, NULL);
+    if (data_home && *data_home)
+        add_base("%s/icons", data_home, NULL);
+    else
+        add_base("%s/.local/share/icons", home, NULL);
+
+    char *dirs = strdup(data_dirs && *data_dirs ? data_dirs
+                                                : "/usr/local/share:/usr/share");
+    for (char *save, *d = strtok_r(dirs, ":", &save); d; d = strtok_r(NULL, ":", &save))
+        add_base("%s/icons", d, NULL);
+    free(dirs);
+}
+
+/* ---- index.theme ---- */
+
+typedef struct {
+    char name[NAME_MAX];
+    int size, scale;
+} ThemeDir;
+
+typedef struct {
+    char name[NAME_MAX];
+    char inherits[512];
+    ThemeDir *dirs;
+    int dir_count;
+} Theme;
+
+static int
+parse_theme(const char *name, Theme *t) {
+    char path[PATH_MAX], line[1024], section[NAME_MAX] = "";
+    FILE *f = NULL;
+
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", name);
+
+    for (int i = 0; i < base_count && !f; i++) {
+        snprintf(path, sizeof(path), "%s/%s/index.theme", bases[i], name);
+        f = fopen(path, "r");
+    }
+    if (!f)
+        return -1;
+
+    ThemeDir *cur = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '[') {
+            char *end = strchr(line, ']');
+            if (!end)
+                continue;
+            *end = '\0';
+            snprintf(section, sizeof(section), "%s", line + 1);
+            cur = NULL;
+            if (strcmp(section, "Icon Theme") != 0) {
+                ThemeDir *dirs = realloc(t->dirs, (t->dir_count + 1) * sizeof(*dirs));
+                if (!dirs)
+                    break;
+                t->dirs = dirs;
+                cur = &t->dirs[t->dir_count++];
+                snprintf(cur->name, sizeof(cur->name), "%s", section);
+                cur->size = 0;
+                cur->scale = 1;
+            }
+            continue;
+        }
+
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        const char *key = line, *val = eq + 1;
+
+        if (!cur && strcmp(key, "Inherits") == 0)
+            snprintf(t->inherits, sizeof(t->inherits), "%s", val);
+        else if (cur && strcmp(key, "Size") == 0)
+            cur->size = atoi(val);
+        else if (cur && strcmp(key, "Scale") == 0)
+            cur->scale = MAX(atoi(val), 1);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* ---- building ---- */
+
+typedef struct {
+    Buf strings, dirs, entries;
+    uint32_t *buckets;
+    uint32_t n_buckets;
+    int rank;                       /* theme currently being scanned */
+    int *entry_rank;
+    uint32_t n_entries;
+} Builder;
+
+static uint32_t
+find_entry(Builder *b, uint32_t hash, const char *name) {
+    const IndexEntry *e = (const IndexEntry *)b->entries.data;
+    for (uint32_t i = b->buckets[hash % b->n_buckets]; i; i = e[i - 1].next) {
+        if (e[i - 1].hash == hash &&
+            strcmp(b->strings.data + e[i - 1].name, name) == 0)
+            return i;
+    }
+    return 0;
+}
+
+static int
+add_dir(Builder *b, const char *path, int size) {
+    struct stat st;
+    IndexDir d = { .mtime_sec = -1, .mtime_nsec = 0, .size = size };
+
+    if (stat(path, &st) == 0) {
+        d.mtime_sec = st.st_mtim.tv_sec;
+        d.mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    d.path = buf_str(&b->strings, path);
+    buf_add(&b->dirs, &d, sizeof(d));
+    return b->dirs.len / sizeof(d) - 1;
+}
+
+static void
+scan_dir(Builder *b, const char *path, int size) {
+    uint32_t dir = add_dir(b, path, size);
+    DIR *d = opendir(path);
+    if (!d)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char name[NAME_MAX + 1];
+        size_t len = strlen(de->d_name);
+
+        /* only PNG, that is what the icon cache can decode */
+        if (len <= 4 || strcmp(de->d_name + len - 4, ".png") != 0)
+            continue;
+        memcpy(name, de->d_name, len - 4);
+        name[len - 4] = '\0';
+
+        uint32_t hash = name_hash(name);
+        uint32_t found = find_entry(b, hash, name);
+        /* an inherited theme never overrides one earlier in the chain */
+        if (found && b->entry_rank[found - 1] < b->rank)
+            continue;
+
+        int *ranks = realloc(b->entry_rank, (b->n_entries + 1) * sizeof(int));
+        if (!ranks)
+            break;
+        b->entry_rank = ranks;
+        b->entry_rank[b->n_entries] = b->rank;
+
+        uint32_t slot = hash % b->n_buckets;
+        IndexEntry e = {
+            .hash = hash,
+            .name = found ? ((IndexEntry *)b->entries.data)[found - 1].name
+                          : buf_str(&b->strings, name),
+            .dir = dir,
+            .next = b->buckets[slot],
+        };
+        buf_add(&b->entries, &e, sizeof(e));
+        b->buckets[slot] = ++b->n_entries;
+    }
+    closedir(d);
+}
+
+static void
+scan_theme(Builder *b, const Theme *t) {
+    char path[PATH_MAX];
+
+    for (int i = 0; i < base_count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", bases[i], t->name);
+        add_dir(b, path, -1);
+        snprintf(path, sizeof(path), "%s/%s/index.theme", bases[i], t->name);
+        add_dir(b, path, -1);
+        for (int j = 0; j < t->dir_count; j++) {
+            snprintf(path, sizeof(path), "%s/%s/%s", bases[i], t->name,
+                     t->dirs[j].name);
+            scan_dir(b, path, t->dirs[j].size * t->dirs[j].scale);
+        }
+    }
+}
+
+static char *
+build_index(size_t *len) {
+    char names[MAX_THEMES][NAME_MAX];
+    int count = 0, done = 0;
+    Builder b = { .n_buckets = ICON_INDEX_BUCKETS };
+    char *out = NULL;
+
+    b.buckets = calloc(b.n_buckets, sizeof(uint32_t));
+    if (!b.buckets)
+        return NULL;
+
+    /* breadth first over Inherits=, hicolor always ends the chain */
+    snprintf(names[count++], NAME_MAX, "%s", ICON_THEME);
+    while (done < count) {
+        Theme t;
+        if (parse_theme(names[done], &t) == 0) {
+            b.rank = done;
+            scan_theme(&b, &t);
+
+            char *save;
+            for (char *p = strtok_r(t.inherits, ",", &save); p && count < MAX_THEMES - 1;
+                 p = strtok_r(NULL, ",", &save)) {
+                bool seen = strcmp(p, "hicolor") == 0;
+                for (int i = 0; i < count && !seen; i++)
+                    seen = strcmp(names[i], p) == 0;
+                if (!seen)
+                    snprintf(names[count++], NAME_MAX, "%s", p);
+            }
+            free(t.dirs);
+        }
+        if (++done == count && strcmp(names[count - 1], "hicolor") != 0 &&
+            strcmp(ICON_THEME, "hicolor") != 0)
+            snprintf(names[count++], NAME_MAX, "hicolor");
+    }
+
+    b.rank = count;
+    scan_dir(&b, "/usr/share/pixmaps", 0);
+
+    IndexHeader h = {
+        .n_dirs = b.dirs.len / sizeof(IndexDir),
+        .n_buckets = b.n_buckets,
+        .n_entries = b.n_entries,
+    };
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.dirs_off = sizeof(h);
+    h.buckets_off = h.dirs_off + b.dirs.len;
+    h.entries_off = h.buckets_off + b.n_buckets * sizeof(uint32_t);
+    h.strings_off = h.entries_off + b.entries.len;
+    h.size = h.strings_off + b.strings.len;
+
+    bool oom = b.dirs.oom || b.entries.oom || b.strings.oom;
+    out = oom ? NULL : malloc(h.size);
+    if (out) {
+        memcpy(out, &h, sizeof(h));
+        memcpy(out + h.dirs_off, b.dirs.data, b.dirs.len);
+        memcpy(out + h.buckets_off, b.buckets, b.n_buckets * sizeof(uint32_t));
+        memcpy(out + h.entries_off, b.entries.data, b.entries.len);
+        memcpy(out + h.strings_off, b.strings.data, b.strings.len);
+        *len = h.size;
+    }
+
+    free(b.buckets);
+    free(b.entry_rank);
+    free(b.dirs.data);
+    free(b.entries.data);
+    free(b.strings.data);
+    return out;
+}
+
+/* ---- persistence ---- */
+
+/* a string offset inside the strings section, which ends in a NUL */
+static bool
+string_ok(const IndexHeader *h, uint32_t off) {
+    return off < h->size - h->strings_off;
+}
+
+/* the cache file may be truncated or corrupt, nothing in it is trusted */
+static bool
+index_ok(const char *data, size_t len) {
+    const IndexHeader *h = (const IndexHeader *)data;
+
+    if (len < sizeof(*h) || memcmp(h->magic, INDEX_MAGIC, 8) != 0 ||
+        h->size != len || h->n_buckets == 0 || h->strings_off >= len ||
+        data[len - 1] != '\0' || h->dirs_off < sizeof(*h) ||
+        h->dirs_off % 8 || h->buckets_off % 4 || h->entries_off % 4 ||
+        h->dirs_off + (size_t)h->n_dirs * sizeof(IndexDir) > h->buckets_off ||
+        h->buckets_off + (size_t)h->n_buckets * sizeof(uint32_t) > h->entries_off ||
+        h->entries_off + (size_t)h->n_entries * sizeof(IndexEntry) > h->strings_off)
+        return false;
+
+    const uint32_t *buckets = (const uint32_t *)(data + h->buckets_off);
+    for (uint32_t i = 0; i < h->n_buckets; i++)
+        if (buckets[i] > h->n_entries)
+            return false;
+
+    /* chains only point back to earlier entries, so they always end */
+    const IndexEntry *entries = (const IndexEntry *)(data + h->entries_off);
+    for (uint32_t i = 0; i < h->n_entries; i++)
+        if (entries[i].dir >= h->n_dirs || entries[i].next > i ||
+            !string_ok(h, entries[i].name))
+            return false;
+
+    /* any directory or index.theme added, removed or changed since the build */
+    const IndexDir *dirs = (const IndexDir *)(data + h->dirs_off);
+    for (uint32_t i = 0; i < h->n_dirs; i++) {
+        struct stat st;
+        if (!string_ok(h, dirs[i].path))
+            return false;
+        bool exists = stat(data + h->strings_off + dirs[i].path, &st) == 0;
+        if (exists != (dirs[i].mtime_sec != -1))
+            return false;
+        if (exists && (st.st_mtim.tv_sec != dirs[i].mtime_sec ||
+                       st.st_mtim.tv_nsec != dirs[i].mtime_nsec))
+            return false;
+    }
+    return true;
+}
+
+static void
+index_path(char *path, size_t size) {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (cache && *cache)
+        snprintf(path, size, "%s/snot", cache);
+    else if (home)
+        snprintf(path, size, "%s/.cache/snot", home);
+    else {
+        path[0] = '\0';
+        return;
+    }
+    mkdir(path, 0755);
+    size_t len = strlen(path);
+    snprintf(path + len, size - len, "/icons-%s.idx", ICON_THEME);
+}
+
+static void
+load_index(void) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    struct stat st;
+
+    index_tried = true;
+    init_bases();
+    index_path(path, sizeof(path));
+
+    if (path[0]) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                if (index_ok(map, st.st_size)) {
+                    close(fd);
+                    index_data = map;
+                    index_len = st.st_size;
+                    return;
+                }
+                munmap(map, st.st_size);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    size_t len;
+    char *data = build_index(&len);
+    if (!data)
+        return;
+
+    index_data = data;
+    index_len = len;
+    if (!path[0])
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    if (write(fd, data, len) == (ssize_t)len && rename(tmp, path) == 0) {
+        close(fd);
+        return;
+    }
+    close(fd);
+    unlink(tmp);
+}
+
+/* returns a path in a static buffer, valid until the next call */
+const char *
+icon_theme_lookup(const char *name, int size) {
+    static char path[PATH_MAX];
+
+    if (!index_tried)
+        load_index();
+    if (!index_data || !name || !*name)
+        return NULL;
+
+    const IndexHeader *h = (const IndexHeader *)index_data;
+    const uint32_t *buckets = (const uint32_t *)(index_data + h->buckets_off);
+    const IndexEntry *entries = (const IndexEntry *)(index_data + h->entries_off);
+    const IndexDir *dirs = (const IndexDir *)(index_data + h->dirs_off);
+    const char *strings = index_data + h->strings_off;
+
+    uint32_t hash = name_hash(name);
+    const IndexDir *best = NULL;
+    int best_dist = INT_MAX;
+
+    for (uint32_t i = buckets[hash % h->n_buckets]; i; i = entries[i - 1].next) {
+        const IndexEntry *e = &entries[i - 1];
+        if (e->hash != hash || strcmp(strings + e->name, name) != 0)
+            continue;
+
+        const IndexDir *d = &dirs[e->dir];
+        /* unknown sizes only win when nothing else matched */
+        int dist = d->size > 0 ? abs(d->size - size) : INT_MAX - 1;
+        /* prefer scaling down over scaling up */
+        if (d->size > 0 && d->size < size)
+            dist += size;
+        if (dist < best_dist) {
+            best = d;
+            best_dist = dist;
+        }
+    }
+
+    if (!best)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/%s.png", strings + best->path, name);
+    return path;
+}
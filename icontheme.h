@@ -0,0 +1,6 @@
+#ifndef ICONTHEME_H
+#define ICONTHEME_H
+
+const char *icon_theme_lookup(const char *name, int size);
+
+#endif
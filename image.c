@@ -0,0 +1,232 @@
+#include <string.h>
+#include <sys/param.h>
+#include "image.h"
+#include "config.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Converts RGB(A) image-data into premultiplied ARGB32 (BGRA in memory on
+ * little endian) and box-filters it down into the icon box in a single
+ * pass: every source pixel is read once, premultiplied and added to the
+ * accumulator of the destination column it falls into. The result is
+ * composited OVER whatever is already in dst. With SSE2 each pixel is one
+ * vector op; built with -mavx2 (or -march=native) four are premultiplied
+ * per op.
+ */
+
+bool
+image_valid(const ImageData *img) {
+    if (!img->pixels || img->width <= 0 || img->height <= 0)
+        return false;
+    if (img->bits_per_sample != 8)
+        return false;
+    if (img->channels != (img->has_alpha ? 4 : 3))
+        return false;
+    /* sizes are from the wire, so multiply in long */
+    if (img->rowstride < (long)img->width * img->channels)
+        return false;
+    /* the last row does not need to be padded out to rowstride */
+    return (long)img->len >= (long)(img->height - 1) * img->rowstride +
+                             (long)img->width * img->channels;
+}
+
+static inline uint32_t
+fetch(const uint8_t *p, int channels) {
+    uint32_t px;
+    if (channels == 4) {
+        memcpy(&px, p, 4);
+        return px;
+    }
+    return p[0] | p[1] << 8 | p[2] << 16 | 0xffu << 24;
+}
+
+#ifdef __SSE2__
+
+/* rgba little endian pixel -> premultiplied r,g,b,a in 32-bit lanes */
+static inline __m128i
+premultiply(uint32_t px) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i keep_a = _mm_set_epi16(0, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i rgb = _mm_set_epi16(0, 0, 0, 0, 0, -1, -1, -1);
+    const __m128i half = _mm_set1_epi16(128);
+
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(px), zero);
+    __m128i a = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_or_si128(_mm_and_si128(a, rgb), keep_a);
+
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), half);
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    return _mm_unpacklo_epi16(t, zero);
+}
+
+#ifdef __AVX2__
+
+/* the same for four pixels at p, one 256-bit op each step */
+static inline void
+premultiply4(const uint8_t *p, int channels, __m128i out[4]) {
+    const __m256i keep_a = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0,
+                                            255, 0, 0, 0, 255, 0, 0, 0);
+    const __m256i rgb = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1,
+                                         0, -1, -1, -1, 0, -1, -1, -1);
+    const __m256i half = _mm256_set1_epi16(128);
+    uint32_t px[4];
+
+    for (int i = 0; i < 4; i++)
+        px[i] = fetch(p + i * channels, channels);
+
+    __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)px));
+    __m256i a = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm256_or_si256(_mm256_and_si256(a, rgb), keep_a);
+
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(v, a), half);
+    t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+
+    __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(t));
+    __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(t, 1));
+    out[0] = _mm256_castsi256_si128(lo);
+    out[1] = _mm256_extracti128_si256(lo, 1);
+    out[2] = _mm256_castsi256_si128(hi);
+    out[3] = _mm256_extracti128_si256(hi, 1);
+}
+
+#endif
+
+static inline uint32_t
+store_px(__m128i acc, uint32_t dst, float inv) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+
+    __m128i s = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(acc), _mm_set1_ps(inv)));
+    /* r,g,b,a -> b,g,r,a */
+    s = _mm_shuffle_epi32(s, _MM_SHUFFLE(3, 0, 1, 2));
+    s = _mm_packs_epi32(s, zero);
+
+    /* dst = src + dst * (255 - a) / 255 */
+    __m128i d = _mm_unpacklo_epi8(_mm_cvtsi32_si128(dst), zero);
+    __m128i ia = _mm_sub_epi16(_mm_set1_epi16(255),
+                               _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, ia), half);
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+    return _mm_cvtsi128_si32(_mm_packus_epi16(_mm_add_epi16(s, t), zero));
+}
+
+#else
+
+typedef struct { uint32_t v[4]; } acc_t;
+
+static inline uint8_t
+mul255(uint32_t a, uint32_t b) {
+    uint32_t t = a * b + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+#endif
+
+void
+image_blit(const ImageData *img, uint8_t *dst, int dst_stride,
+           int box_w, int box_h) {
+    if (!image_valid(img) || box_w <= 0 || box_h <= 0)
+        return;
+
+    box_w = MIN(box_w, ICON_MAX_SIZE);
+    box_h = MIN(box_h, ICON_MAX_SIZE);
+
+    /* fit into the box keeping the aspect ratio, never upscale */
+    int w = img->width, h = img->height;
+    if (w > box_w || h > box_h) {
+        if ((long)w * box_h > (long)h * box_w) {
+            h = MAX(1, (int)((long)h * box_w / w));
+            w = box_w;
+        } else {
+            w = MAX(1, (int)((long)w * box_h / h));
+            h = box_h;
+        }
+    }
+
+    dst += ((box_h - h) / 2) * dst_stride + ((box_w - w) / 2) * 4;
+
+#ifdef __SSE2__
+    __m128i acc[ICON_MAX_SIZE];
+#else
+    acc_t acc[ICON_MAX_SIZE];
+#endif
+    int sy = 0;
+
+    for (int y = 0; y < h; y++) {
+        int sy1 = (int)((long)(y + 1) * img->height / h);
+
+        memset(acc, 0, sizeof(acc[0]) * w);
+
+        /* walk the source rows of this band front to back */
+        for (int r = sy; r < sy1; r++) {
+            const uint8_t *p = img->pixels + (long)r * img->rowstride;
+            int sx = 0;
+#ifdef __AVX2__
+            __m128i pre[4];
+            int have = 0, used = 0;
+#endif
+
+            for (int x = 0; x < w; x++) {
+                int sx1 = (int)((long)(x + 1) * img->width / w);
+                for (; sx < sx1; sx++, p += img->channels) {
+#ifdef __AVX2__
+                    if (used == have) {
+                        if (img->width - sx >= 4) {
+                            premultiply4(p, img->channels, pre);
+                            have = 4;
+                        } else {
+                            pre[0] = premultiply(fetch(p, img->channels));
+                            have = 1;
+                        }
+                        used = 0;
+                    }
+                    acc[x] = _mm_add_epi32(acc[x], pre[used++]);
+#elif defined(__SSE2__)
+                    uint32_t px = fetch(p, img->channels);
+                    acc[x] = _mm_add_epi32(acc[x], premultiply(px));
+#else
+                    uint32_t px = fetch(p, img->channels);
+                    uint32_t a = px >> 24;
+                    acc[x].v[0] += mul255(px & 0xff, a);
+                    acc[x].v[1] += mul255((px >> 8) & 0xff, a);
+                    acc[x].v[2] += mul255((px >> 16) & 0xff, a);
+                    acc[x].v[3] += a;
+#endif
+                }
+            }
+        }
+
+        uint32_t *out = (uint32_t *)(dst + (long)y * dst_stride);
+        int rows = sy1 - sy;
+        int sx = 0;
+
+        for (int x = 0; x < w; x++) {
+            int sx1 = (int)((long)(x + 1) * img->width / w);
+            uint32_t n = (sx1 - sx) * rows;
+#ifdef __SSE2__
+            out[x] = store_px(acc[x], out[x], 1.0f / n);
+#else
+            uint32_t r = (acc[x].v[0] + n / 2) / n;
+            uint32_t g = (acc[x].v[1] + n / 2) / n;
+            uint32_t b = (acc[x].v[2] + n / 2) / n;
+            uint32_t a = (acc[x].v[3] + n / 2) / n;
+            uint32_t d = out[x];
+            uint32_t ia = 255 - a;
+            b += mul255(d & 0xff, ia);
+            g += mul255((d >> 8) & 0xff, ia);
+            r += mul255((d >> 16) & 0xff, ia);
+            a += mul255(d >> 24, ia);
+            out[x] = b | g << 8 | r << 16 | a << 24;
+#endif
+            sx = sx1;
+        }
+        sy = sy1;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* raw image-data hint, (iiibiiay); pixels are borrowed from the message */
+typedef struct {
+    int32_t width, height;
+    int32_t rowstride;
+    bool has_alpha;
+    int32_t bits_per_sample;
+    int32_t channels;
+    const uint8_t *pixels;
+    int len;
+} ImageData;
+
+bool image_valid(const ImageData *img);
+void image_blit(const ImageData *img, uint8_t *dst, int dst_stride,
+                int box_w, int box_h);
+
+#endif
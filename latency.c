@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <time.h>
+#include "latency.h"
+
+/*
+ * Log-linear histograms in the style of HdrHistogram: values below
+ * SUB are kept exactly, above that each power of two is split into SUB
+ * buckets, so any value is off by at most 1/SUB. Microseconds up to
+ * 2^32 (71 minutes) fit; anything longer lands in the last bucket.
+ */
+#define SUB_BITS 4
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((32 - SUB_BITS + 1) * SUB)
+
+typedef struct {
+    uint32_t counts[BUCKETS];
+    unsigned long total;
+    uint64_t max;
+} Histogram;
+
+static Histogram stages[LAT_COUNT];
+static uint64_t received;           /* latency_receive() of the current call */
+
+static const char *stage_names[LAT_COUNT] = {
+    [LAT_REPLY] = "reply",
+    [LAT_LAYOUT] = "layout",
+    [LAT_RASTER] = "raster",
+    [LAT_CONFIGURE] = "configure",
+    [LAT_COMMIT] = "commit",
+    [LAT_PRESENT] = "present",
+    [LAT_DRAW] = "draw",
+};
+
+static int
+bucket_of(uint64_t v) {
+    if (v >= (uint64_t)1 << 32)
+        return BUCKETS - 1;
+    if (v < SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return (shift + 1) * SUB + (int)((v >> shift) - SUB);
+}
+
+/* the largest value that lands in bucket b */
+static uint64_t
+bucket_top(int b) {
+    if (b < SUB)
+        return b;
+    int shift = b / SUB - 1;
+    return (((uint64_t)(SUB + b % SUB + 1)) << shift) - 1;
+}
+
+uint64_t
+latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the same clock in ms, for deadlines and rates */
+unsigned long
+latency_now_ms(void) {
+    return latency_now() / 1000;
+}
+
+/* stamps the call being handled; the transports call this on arrival */
+uint64_t
+latency_receive(void) {
+    return received = latency_now();
+}
+
+uint64_t
+latency_received(void) {
+    return received;
+}
+
+void
+latency_record_at(int stage, uint64_t since, uint64_t at) {
+    Histogram *h = &stages[stage];
+    uint64_t v = at > since ? at - since : 0;
+
+    if (!since)
+        return;
+    h->counts[bucket_of(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+void
+latency_record(int stage, uint64_t since) {
+    latency_record_at(stage, since, latency_now());
+}
+
+static uint64_t
+percentile(const Histogram *h, unsigned long permille) {
+    unsigned long rank = (h->total * permille + 999) / 1000, seen = 0;
+
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank && seen)
+            return bucket_top(b) < h->max ? bucket_top(b) : h->max;
+    }
+    return h->max;
+}
+
+void
+latency_summary(int stage, LatencySummary *s) {
+    const Histogram *h = &stages[stage];
+
+    s->count = h->total;
+    s->p50 = percentile(h, 500);
+    s->p90 = percentile(h, 900);
+    s->p99 = percentile(h, 990);
+    s->max = h->max;
+}
+
+const char *
+latency_stage_name(int stage) {
+    return stage_names[stage];
+}
@@ -0,0 +1,34 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* stages of a notification, each timed from its Notify arriving, and
+ * how long a full redraw takes */
+enum {
+    LAT_REPLY,                      /* reply handed to the transport */
+    LAT_LAYOUT,                     /* first layout done */
+    LAT_RASTER,                     /* first full raster done */
+    LAT_CONFIGURE,                  /* first configure from the compositor */
+    LAT_COMMIT,                     /* first buffer committed */
+    LAT_PRESENT,                    /* on screen */
+    LAT_STAGES,
+    LAT_DRAW = LAT_STAGES,          /* one draw_notification() */
+    LAT_COUNT
+};
+
+typedef struct {
+    unsigned long count;
+    uint64_t p50, p90, p99, max;    /* us */
+} LatencySummary;
+
+uint64_t latency_now(void);
+unsigned long latency_now_ms(void);
+uint64_t latency_receive(void);
+uint64_t latency_received(void);
+void latency_record(int stage, uint64_t since);
+void latency_record_at(int stage, uint64_t since, uint64_t at);
+void latency_summary(int stage, LatencySummary *s);
+const char *latency_stage_name(int stage);
+
+#endif
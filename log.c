@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include "log.h"
+
+/*
+ * A bounded multi-producer ring after Vyukov: a producer claims a slot
+ * by advancing head with a compare-and-swap and publishes it through
+ * the slot's sequence number, so the icon worker can log next to the
+ * main loop without a lock. Only the main loop consumes.
+ */
+typedef struct {
+    unsigned long seq;
+    unsigned char level;
+    unsigned short len;
+    char text[LOG_LINE];
+} LogRecord;
+
+static LogRecord ring[LOG_RING];
+static unsigned long head;          /* next slot to claim */
+static unsigned long tail;          /* next slot to write out */
+static unsigned long dropped;
+static unsigned long dropped_reported;
+static int out_fd = -1;
+
+static const char *prefixes[] = {
+    [LOG_ERROR] = "error: ",
+    [LOG_WARN] = "warning: ",
+    [LOG_INFO] = "",
+    [LOG_DEBUG] = "",
+};
+
+void
+log_init(int fd) {
+    for (unsigned long i = 0; i < LOG_RING; i++)
+        ring[i].seq = i;
+    out_fd = fd;
+}
+
+void
+log_write(int level, const char *fmt, ...) {
+    unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    LogRecord *r;
+    va_list ap;
+
+    for (;;) {
+        r = &ring[pos % LOG_RING];
+        long diff = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+
+    int n = snprintf(r->text, LOG_LINE, "%s", prefixes[level]);
+    va_start(ap, fmt);
+    n += vsnprintf(r->text + n, LOG_LINE - n, fmt, ap);
+    va_end(ap);
+    if (n > LOG_LINE - 1)
+        n = LOG_LINE - 1;
+    if (n == 0 || r->text[n - 1] != '\n') {
+        if (n == LOG_LINE - 1)
+            n--;
+        r->text[n++] = '\n';
+    }
+    r->len = n;
+    r->level = level;
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static bool
+log_pending(void) {
+    return __atomic_load_n(&ring[tail % LOG_RING].seq, __ATOMIC_ACQUIRE) == tail + 1 ||
+           __atomic_load_n(&dropped, __ATOMIC_RELAXED) != dropped_reported;
+}
+
+int
+log_prepare(fd_set *write_fds) {
+    if (out_fd < 0 || !log_pending())
+        return -1;
+    FD_SET(out_fd, write_fds);
+    return out_fd;
+}
+
+/*
+ * Writes as many whole records as fit in PIPE_BUF: a pipe that polls
+ * writable takes that much without blocking.
+ */
+static int
+flush_once(void) {
+    static char buf[PIPE_BUF];
+    size_t len = 0;
+    unsigned long lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+
+    if (lost != dropped_reported) {
+        len = snprintf(buf, sizeof(buf), "[%lu log records dropped]\n",
+                       lost - dropped_reported);
+        dropped_reported = lost;
+    }
+    for (;;) {
+        LogRecord *r = &ring[tail % LOG_RING];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1 ||
+            len + r->len > sizeof(buf))
+            break;
+        memcpy(buf + len, r->text, r->len);
+        len += r->len;
+        __atomic_store_n(&r->seq, tail + LOG_RING, __ATOMIC_RELEASE);
+        tail++;
+    }
+    if (len && write(out_fd, buf, len) < 0 && errno != EAGAIN)
+        return -1;
+    return len;
+}
+
+void
+log_dispatch(fd_set *write_fds) {
+    if (out_fd >= 0 && FD_ISSET(out_fd, write_fds))
+        flush_once();
+}
+
+/* at exit; this one may block */
+void
+log_drain(void) {
+    if (out_fd < 0)
+        return;
+    while (log_pending() && flush_once() > 0)
+        ;
+}
+
+unsigned long
+log_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,40 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <sys/select.h>
+
+/*
+ * Log records are formatted into a fixed ring and written out by the
+ * main loop once the output is writable, so logging never blocks on a
+ * full pipe. A record that finds the ring full is dropped and counted.
+ * Calls above LOG_LEVEL (config.h) compile to nothing, arguments and all.
+ */
+enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+#define LOG_RING 256                /* records, a power of two */
+#define LOG_LINE 160                /* bytes per record, longer ones are cut */
+
+#define log_at(level, ...) do { \
+        if ((level) <= LOG_LEVEL) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+void log_init(int fd);
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int log_prepare(fd_set *write_fds);
+void log_dispatch(fd_set *write_fds);
+void log_drain(void);
+unsigned long log_dropped(void);
+
+#endif
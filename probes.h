@@ -0,0 +1,21 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT tracepoints of the "snot" provider, built in with USDT = 1 in
+ * config.mk. A probe nobody is attached to is a single nop; its
+ * arguments are still evaluated, so they are kept cheap. bpf/ has
+ * bpftrace scripts built on them.
+ */
+#ifdef SNOT_USDT
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(snot, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(snot, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(snot, name, a, b, c)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
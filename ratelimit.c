@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "ratelimit.h"
+#include "stats.h"
+#include "config.h"
+
+/* slots looked at per lookup; a sender lives in one of these */
+#define RATE_PROBE 4
+
+/*
+ * Token buckets per sender in a fixed open-addressed table. A lookup
+ * touches at most RATE_PROBE slots; when all of them are taken by other
+ * senders the one that was quiet the longest is recycled, so the table
+ * never grows and a flood of new senders cannot starve the lookup.
+ */
+static RateSender senders[RATE_SENDERS];
+static RateStats stats;
+
+static uint32_t
+sender_hash(const char *app, uint32_t pid) {
+    uint32_t h = 2166136261u;
+
+    for (; *app; app++)
+        h = (h ^ (unsigned char)*app) * 16777619u;
+    for (int i = 0; i < 4; i++, pid >>= 8)
+        h = (h ^ (pid & 0xff)) * 16777619u;
+    return h ? h : 1;
+}
+
+RateSender *
+ratelimit_get(const char *app_name, uint32_t pid, unsigned long now) {
+    const char *app = app_name ? app_name : "";
+    uint32_t h = sender_hash(app, pid);
+    RateSender *victim = NULL;
+
+    for (int i = 0; i < RATE_PROBE; i++) {
+        RateSender *s = &senders[(h + i) % RATE_SENDERS];
+
+        if (s->hash == h && s->pid == pid &&
+            strncmp(s->app, app, sizeof(s->app) - 1) == 0) {
+            s->seen = now;
+            return s;
+        }
+        if (!s->hash) {
+            if (!victim || victim->hash)
+                victim = s;
+        } else if (!victim || (victim->hash && s->seen < victim->seen)) {
+            victim = s;
+        }
+    }
+
+    if (victim->hash)
+        stats.evictions++;
+    else
+        stats.senders++;
+
+    memset(victim, 0, sizeof(*victim));
+    victim->hash = h;
+    victim->pid = pid;
+    snprintf(victim->app, sizeof(victim->app), "%s", app);
+    victim->tokens = RATE_BURST;
+    victim->stamp = now;
+    victim->seen = now;
+    return victim;
+}
+
+/* returns 1 if s may show another notification now */
+int
+ratelimit_take(RateSender *s, unsigned long now) {
+    unsigned long gained = (now - s->stamp) / RATE_REFILL;
+
+    if (gained) {
+        s->tokens = gained >= RATE_BURST ? RATE_BURST
+                  : s->tokens + (int)gained > RATE_BURST ? RATE_BURST
+                  : s->tokens + (int)gained;
+        s->stamp += gained * RATE_REFILL;
+    }
+
+    if (s->tokens > 0) {
+        s->tokens--;
+        stats.admitted++;
+        return 1;
+    }
+    stat_add(&counters.rate_limited, 1);
+    return 0;
+}
+
+/*
+ * Moves every bucket keyed on from over to to, merged with any bucket to
+ * already has: the tokens spent under from are taken from it and its
+ * aggregate is kept if it has one, so a sender whose pid turns up late
+ * neither gets a second burst nor a second "N more" entry. Walks the
+ * table, but only once per new connection.
+ */
+void
+ratelimit_rekey(uint32_t from, uint32_t to, unsigned long now) {
+    for (int i = 0; i < RATE_SENDERS; i++) {
+        RateSender old = senders[i];
+
+        if (!old.hash || old.pid != from)
+            continue;
+        memset(&senders[i], 0, sizeof(senders[i]));
+        stats.senders--;
+
+        RateSender *s = ratelimit_get(old.app, to, now);
+        s->tokens -= RATE_BURST - old.tokens;
+        if (s->tokens < 0)
+            s->tokens = 0;
+        if (!s->agg_id) {
+            s->agg_id = old.agg_id;
+            s->agg_count = old.agg_count;
+        }
+    }
+}
+
+const RateStats *
+ratelimit_get_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,30 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+/* one tracked sender: an app_name as sent from one process, or from
+ * one bus connection while its pid is not known yet */
+typedef struct {
+    uint32_t hash;                  /* 0: free slot */
+    uint32_t pid;
+    char app[64];
+    int tokens;
+    unsigned long stamp;            /* ms the last token was credited */
+    unsigned long seen;             /* ms of the last message, for eviction */
+    uint32_t agg_id;                /* "N more from <app>" notification */
+    int agg_count;
+} RateSender;
+
+typedef struct {
+    unsigned long admitted;
+    unsigned long evictions;
+    unsigned int senders;
+} RateStats;
+
+RateSender *ratelimit_get(const char *app_name, uint32_t pid, unsigned long now);
+int ratelimit_take(RateSender *s, unsigned long now);
+void ratelimit_rekey(uint32_t from, uint32_t to, unsigned long now);
+const RateStats *ratelimit_get_stats(void);
+
+#endif
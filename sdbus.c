@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/param.h>
+#include <systemd/sd-bus.h>
+#include "dbus.h"
+#include "snot.h"
+#include "hints.h"
+#include "bus.h"
+#include "latency.h"
+#include "stats.h"
+#include "log.h"
+#include "config.h"
+
+/*
+ * The same service as dbus.c, on sd-bus. sd-bus writes replies itself
+ * from sd_bus_process() as the socket allows, so there is no outbox
+ * here, and introspection comes from the vtables.
+ */
+static sd_bus *bus;
+static DBusFlushStats flush_stats;
+
+static void
+send_message(sd_bus_message *msg) {
+    if (sd_bus_send(bus, msg, NULL) < 0) {
+        fprintf(stderr, "Failed to send D-Bus message\n");
+        return;
+    }
+    flush_stats.messages++;
+    flush_stats.last_messages++;
+}
+
+/* ownership of a held reply passes to bus.c until send_held() */
+static bool
+hold_reply(sd_bus_message *reply, uint64_t received) {
+    if (bus_hold_reply(sd_bus_message_ref(reply), received))
+        return true;
+    sd_bus_message_unref(reply);
+    return false;
+}
+
+/* received: when the call this answers arrived, for LAT_REPLY */
+static void
+send_reply(sd_bus_message *reply, uint64_t received) {
+    send_message(reply);
+    latency_record(LAT_REPLY, received);
+}
+
+static void
+send_held(void *reply, uint64_t received) {
+    send_reply(reply, received);
+    sd_bus_message_unref(reply);
+}
+
+static int
+pid_reply(sd_bus_message *reply, void *data, sd_bus_error *error) {
+    uint32_t pid;
+
+    if (!sd_bus_message_is_method_error(reply, NULL) &&
+        sd_bus_message_read(reply, "u", &pid) >= 0)
+        bus_set_pid(data, pid);
+    free(data);
+    return 0;
+}
+
+static int
+query_pid(const char *sender) {
+    sd_bus_message *call = NULL;
+    char *name = strdup(sender);
+    int r = -1;
+
+    if (name &&
+        sd_bus_message_new_method_call(bus, &call, "org.freedesktop.DBus",
+                                       "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus",
+                                       "GetConnectionUnixProcessID") >= 0 &&
+        sd_bus_message_append(call, "s", sender) >= 0 &&
+        sd_bus_call_async(bus, NULL, call, pid_reply, name,
+                          PID_LOOKUP_TIMEOUT * 1000ULL) >= 0)
+        r = 0;
+    sd_bus_message_unref(call);
+    if (r < 0)
+        free(name);
+    return r;
+}
+
+/* LazyHint on sd-bus: the message plus the image header already read,
+ * the pixels are still inside the message */
+void
+lazy_hint_retain(LazyHint *dst, const LazyHint *src) {
+    *dst = *src;
+    if (dst->msg)
+        sd_bus_message_ref(dst->msg);
+}
+
+void
+lazy_hint_release(LazyHint *h) {
+    if (h->msg)
+        sd_bus_message_unref(h->msg);
+    h->msg = NULL;
+    h->key = HINT_UNKNOWN;
+}
+
+int
+hint_get_image(const LazyHint *h, ImageData *img) {
+    if (!h->msg)
+        return -1;
+    *img = h->img;
+    return image_valid(img) ? 0 : -1;
+}
+
+static int
+read_image(sd_bus_message *msg, ImageData *img) {
+    int has_alpha;
+    const void *pixels;
+    size_t len;
+
+    if (sd_bus_message_enter_container(msg, 'v', "(iiibiiay)") < 0 ||
+        sd_bus_message_enter_container(msg, 'r', "iiibiiay") < 0 ||
+        sd_bus_message_read(msg, "iiibii", &img->width, &img->height,
+                            &img->rowstride, &has_alpha,
+                            &img->bits_per_sample, &img->channels) < 0 ||
+        sd_bus_message_read_array(msg, 'y', &pixels, &len) < 0 ||
+        sd_bus_message_exit_container(msg) < 0 ||
+        sd_bus_message_exit_container(msg) < 0)
+        return -1;
+
+    img->has_alpha = has_alpha;
+    img->pixels = pixels;
+    img->len = len;
+    return 0;
+}
+
+/* reads one hint value, or skips it if it is not of the expected type */
+static int
+read_hint(sd_bus_message *msg, int id, Hints *h) {
+    const char *contents;
+    char type;
+    int r;
+
+    if ((r = sd_bus_message_peek_type(msg, &type, &contents)) < 0)
+        return r;
+
+    switch (id) {
+    case HINT_URGENCY:
+        if (strcmp(contents, "y") == 0) {
+            uint8_t urgency;
+            if ((r = sd_bus_message_read(msg, "v", "y", &urgency)) < 0)
+                return r;
+            h->urgency = MIN(urgency, URGENCY_CRITICAL);
+            return 0;
+        }
+        break;
+    case HINT_VALUE:
+        if (strcmp(contents, "i") == 0 || strcmp(contents, "u") == 0) {
+            int32_t value;
+            if ((r = sd_bus_message_read(msg, "v", contents, &value)) < 0)
+                return r;
+            h->value = MAX(0, MIN(value, 100));
+            return 0;
+        }
+        break;
+    case HINT_TRANSIENT:
+    case HINT_RESIDENT:
+        if (strcmp(contents, "b") == 0) {
+            int b;
+            if ((r = sd_bus_message_read(msg, "v", "b", &b)) < 0)
+                return r;
+            if (id == HINT_TRANSIENT)
+                h->transient = b;
+            else
+                h->resident = b;
+            return 0;
+        }
+        break;
+    case HINT_CATEGORY:
+    case HINT_IMAGE_PATH:
+    case HINT_DESKTOP_ENTRY:
+    case HINT_STACK_TAG:
+        if (strcmp(contents, "s") == 0) {
+            const char *str;
+            if ((r = sd_bus_message_read(msg, "v", "s", &str)) < 0)
+                return r;
+            if (id == HINT_CATEGORY)
+                h->category = str;
+            else if (id == HINT_IMAGE_PATH)
+                h->image_path = str;
+            else if (id == HINT_DESKTOP_ENTRY)
+                h->desktop_entry = str;
+            else
+                h->stack_tag = str;
+            return 0;
+        }
+        break;
+    case HINT_IMAGE_DATA:
+    case HINT_ICON_DATA:
+        /* image-data wins over the deprecated icon_data */
+        if (strcmp(contents, "(iiibiiay)") == 0 &&
+            (id == HINT_IMAGE_DATA || h->image_data.key == HINT_UNKNOWN)) {
+            if (read_image(msg, &h->image_data.img) < 0)
+                return -EINVAL;
+            h->image_data.msg = msg;
+            h->image_data.key = id;
+            return 0;
+        }
+        break;
+    }
+
+    return sd_bus_message_skip(msg, "v");
+}
+
+static int
+parse_hints(sd_bus_message *msg, Hints *h) {
+    int r;
+
+    if ((r = sd_bus_message_enter_container(msg, 'a', "{sv}")) < 0)
+        return r;
+    while ((r = sd_bus_message_enter_container(msg, 'e', "sv")) > 0) {
+        const char *key;
+
+        if ((r = sd_bus_message_read(msg, "s", &key)) < 0)
+            return r;
+        int id = hint_lookup(key);
+        r = id == HINT_UNKNOWN ? sd_bus_message_skip(msg, "v")
+                               : read_hint(msg, id, h);
+        if (r < 0 || (r = sd_bus_message_exit_container(msg)) < 0)
+            return r;
+    }
+    if (r < 0)
+        return r;
+    return sd_bus_message_exit_container(msg);
+}
+
+/* one notification's arguments, strings borrowed from the message */
+typedef struct {
+    const char *app_name, *app_icon, *summary, *body;
+    uint32_t replaces_id;
+    int32_t expire_timeout;
+    Hints hints;
+} NotifyArgs;
+
+/* reads one notification's susssasa{sv}i without inserting it */
+static int
+read_notify(sd_bus_message *msg, NotifyArgs *a) {
+    int r;
+
+    hints_init(&a->hints);
+    if ((r = sd_bus_message_read(msg, "susss", &a->app_name, &a->replaces_id,
+                                 &a->app_icon, &a->summary, &a->body)) < 0 ||
+        (r = sd_bus_message_skip(msg, "as")) < 0 ||
+        (r = parse_hints(msg, &a->hints)) < 0 ||
+        (r = sd_bus_message_read(msg, "i", &a->expire_timeout)) < 0)
+        return r;
+    return 0;
+}
+
+static uint32_t
+insert_notify(const NotifyArgs *a, uint32_t pid) {
+    return add_notification(a->summary, a->body, a->app_name, a->app_icon,
+                            a->replaces_id, a->expire_timeout, &a->hints, pid);
+}
+
+static int
+method_notify(sd_bus_message *msg, void *data, sd_bus_error *err) {
+    sd_bus_message *reply;
+    uint32_t id;
+    uint64_t received = latency_receive();
+    int r;
+
+    NotifyArgs args;
+    if ((r = read_notify(msg, &args)) < 0)
+        return r;
+    uint32_t pid = bus_sender_pid(sd_bus_message_get_sender(msg), query_pid);
+    id = insert_notify(&args, pid);
+
+    if ((r = sd_bus_message_new_method_return(msg, &reply)) < 0)
+        return r;
+    sd_bus_message_append(reply, "u", id);
+    if (!hold_reply(reply, received))
+        send_reply(reply, received);
+    sd_bus_message_unref(reply);
+    return 1;
+}
+
+/*
+ * The whole array is read before any of it is shown, so a bad entry, or
+ * one past BATCH_MAX (LimitsExceeded), fails the call with nothing
+ * inserted and no ids lost.
+ */
+static int
+method_batch(sd_bus_message *msg, void *data, sd_bus_error *err) {
+    static NotifyArgs args[BATCH_MAX];
+    static uint32_t ids[BATCH_MAX];
+    sd_bus_message *reply;
+    uint64_t received = latency_receive();
+    int count = 0, r;
+
+    if ((r = sd_bus_message_enter_container(msg, 'a', "(susssasa{sv}i)")) < 0)
+        return r;
+    while ((r = sd_bus_message_enter_container(msg, 'r', "susssasa{sv}i")) > 0) {
+        if (count == BATCH_MAX)
+            return sd_bus_error_setf(err, SD_BUS_ERROR_LIMITS_EXCEEDED,
+                                     "Batch takes at most %d notifications",
+                                     BATCH_MAX);
+        if ((r = read_notify(msg, &args[count])) < 0 ||
+            (r = sd_bus_message_exit_container(msg)) < 0)
+            return r;
+        count++;
+    }
+    if (r < 0)
+        return r;
+
+    uint32_t pid = bus_sender_pid(sd_bus_message_get_sender(msg), query_pid);
+    for (int i = 0; i < count; i++)
+        ids[i] = insert_notify(&args[i], pid);
+
+    if ((r = sd_bus_message_new_method_return(msg, &reply)) < 0)
+        return r;
+    sd_bus_message_append_array(reply, 'u', ids, count * sizeof(ids[0]));
+    if (!hold_reply(reply, received))
+        send_reply(reply, received);
+    sd_bus_message_unref(reply);
+    bus_count_batch(count);
+    return 1;
+}
+
+static int
+method_get_server_information(sd_bus_message *msg, void *data, sd_bus_error *err) {
+    sd_bus_message *reply;
+    int r;
+
+    if ((r = sd_bus_message_new_method_return(msg, &reply)) < 0)
+        return r;
+    sd_bus_message_append(reply, "ssss", BUS_SERVER_NAME, BUS_SERVER_VENDOR,
+                          BUS_SERVER_VERSION, BUS_SPEC_VERSION);
+    send_message(reply);
+    sd_bus_message_unref(reply);
+    return 1;
+}
+
+static int
+method_get_capabilities(sd_bus_message *msg, void *data, sd_bus_error *err) {
+    sd_bus_message *reply;
+    int r;
+
+    if ((r = sd_bus_message_new_method_return(msg, &reply)) < 0)
+        return r;
+    sd_bus_message_append_strv(reply, (char **)bus_capabilities);
+    send_message(reply);
+    sd_bus_message_unref(reply);
+    return 1;
+}
+
+static int
+method_get_stats(sd_bus_message *msg, void *data, sd_bus_error *err) {
+    static StatEntry entries[STATS_MAX];
+    sd_bus_message *reply = NULL;
+    int count = MIN(stats_collect(entries, STATS_MAX), STATS_MAX);
+    int r;
+
+    if ((r = sd_bus_message_new_method_return(msg, &reply)) < 0 ||
+        (r = sd_bus_message_open_container(reply, 'a', "{sd}")) < 0)
+        goto out;
+    for (int i = 0; i < count; i++)
+        if ((r = sd_bus_message_append(reply, "{sd}", entries[i].name,
+                                       entries[i].value)) < 0)
+            goto out;
+    if ((r = sd_bus_message_close_container(reply)) < 0)
+        goto out;
+    send_message(reply);
+    r = 1;
+out:
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+static const sd_bus_vtable notify_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Notify", "susssasa{sv}i", "u", method_notify, 0),
+    SD_BUS_METHOD("GetServerInformation", "", "ssss",
+                  method_get_server_information, 0),
+    SD_BUS_METHOD("GetCapabilities", "", "as", method_get_capabilities, 0),
+    SD_BUS_SIGNAL("NotificationClosed", "uu", 0),
+    SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable batch_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Batch", "a(susssasa{sv}i)", "au", method_batch, 0),
+    SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable stats_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("GetStats", "", "a{sd}", method_get_stats, 0),
+    SD_BUS_VTABLE_END
+};
+
+int
+dbus_init(void) {
+    int r;
+
+    if ((r = sd_bus_open_user(&bus)) < 0) {
+        fprintf(stderr, "Failed to connect to bus: %s\n", strerror(-r));
+        return -1;
+    }
+
+    if ((r = sd_bus_add_object_vtable(bus, NULL, SNOT_DBUS_PATH,
+                                      SNOT_DBUS_INTERFACE,
+                                      notify_vtable, NULL)) < 0 ||
+        (r = sd_bus_add_object_vtable(bus, NULL, SNOT_DBUS_PATH,
+                                      SNOT_BATCH_INTERFACE,
+                                      batch_vtable, NULL)) < 0 ||
+        (r = sd_bus_add_object_vtable(bus, NULL, SNOT_DBUS_PATH,
+                                      SNOT_STATS_INTERFACE,
+                                      stats_vtable, NULL)) < 0) {
+        fprintf(stderr, "Failed to register object path: %s\n", strerror(-r));
+        return -1;
+    }
+
+    if ((r = sd_bus_request_name(bus, SNOT_DBUS_INTERFACE,
+                                 SD_BUS_NAME_REPLACE_EXISTING)) < 0) {
+        fprintf(stderr, "Failed to request name: %s\n", strerror(-r));
+        return -1;
+    }
+
+    log_info("D-Bus initialized successfully\n");
+    return 0;
+}
+
+void
+dbus_destroy(void) {
+    if (bus) {
+        bus_flush_held(send_held);
+        sd_bus_flush_close_unref(bus);
+        bus = NULL;
+    }
+}
+
+int
+dbus_prepare(fd_set *read_fds, fd_set *write_fds) {
+    int fd = sd_bus_get_fd(bus);
+    int events = sd_bus_get_events(bus);
+
+    if (fd < 0 || events < 0)
+        return -1;
+    if (events & POLLIN)
+        FD_SET(fd, read_fds);
+    if (events & POLLOUT)
+        FD_SET(fd, write_fds);
+    return fd;
+}
+
+int
+dbus_dispatch(fd_set *read_fds, fd_set *write_fds) {
+    int r;
+
+    flush_stats.last_messages = 0;
+    while ((r = sd_bus_process(bus, NULL)) > 0)
+        ;
+    if (r < 0) {
+        fprintf(stderr, "sd_bus_process failed: %s\n", strerror(-r));
+        return -1;
+    }
+
+    if (flush_stats.last_messages) {
+        flush_stats.flushes++;
+        if (flush_stats.last_messages > flush_stats.max_messages)
+            flush_stats.max_messages = flush_stats.last_messages;
+    }
+    return 0;
+}
+
+const DBusFlushStats *
+dbus_get_flush_stats(void) {
+    return &flush_stats;
+}
+
+void
+dbus_emit_closed(uint32_t id, uint32_t reason) {
+    sd_bus_message *signal;
+
+    if (sd_bus_message_new_signal(bus, &signal, SNOT_DBUS_PATH,
+                                  SNOT_DBUS_INTERFACE,
+                                  "NotificationClosed") < 0)
+        return;
+    sd_bus_message_append(signal, "uu", id, reason);
+    send_message(signal);
+    sd_bus_message_unref(signal);
+}
+
+/* ms until sd-bus wants processing again, its async call timeouts
+ * included; -1 if it has no deadline */
+long
+dbus_next_timeout(void) {
+    uint64_t usec, now;
+
+    if (sd_bus_get_timeout(bus, &usec) < 0 || usec == UINT64_MAX)
+        return -1;
+    now = latency_now();
+    return usec > now ? (long)((usec - now + 999) / 1000) : 0;
+}
+
+long
+dbus_release_replies(void) {
+    return bus_release_replies(send_held);
+}
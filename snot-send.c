@@ -0,0 +1,127 @@
+/*
+ * snot-send - send notifications to snot over its local socket
+ *
+ * usage: snot-send [-a app] [-i icon] [-u 0|1|2] [-t ms] [-r id]
+ *                  [-n count [-b]] summary [body]
+ *
+ * With -n the same notification is sent count times, pipelined one per
+ * packet, or with -b packed into as few packets as fit. The ids are
+ * printed one per line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sockproto.h"
+#include "config.h"
+
+/* requests in flight before a reply is read, so neither side's socket
+ * buffer fills up */
+#define WINDOW 32
+
+static char buf[SOCK_PACKET_MAX];
+
+static void
+die(const char *msg) {
+    fprintf(stderr, "snot-send: %s\n", msg);
+    exit(1);
+}
+
+static void
+usage(void) {
+    die("usage: snot-send [-a app] [-i icon] [-u 0|1|2] [-t ms] [-r id] "
+        "[-n count [-b]] summary [body]");
+}
+
+static int
+connect_snot(void) {
+    struct sockaddr_un addr;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int fd;
+
+    if (!dir)
+        die("XDG_RUNTIME_DIR is not set");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", dir, SOCKET_NAME);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die(strerror(errno));
+    return fd;
+}
+
+/* sends up to count copies of n in one packet, returns how many fit */
+static int
+send_packet(int fd, const SockNotify *n, int count) {
+    SockHeader hdr = { SOCK_MAGIC, 0 };
+    size_t off = sizeof(hdr), next;
+
+    while (hdr.count < (unsigned)count &&
+           (next = sock_pack(buf, sizeof(buf), off, n)))
+        off = next, hdr.count++;
+    if (!hdr.count)
+        die("notification too large");
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    if (send(fd, buf, off, 0) < 0)
+        die(strerror(errno));
+    return hdr.count;
+}
+
+static void
+read_reply(int fd) {
+    static uint32_t reply[SOCK_PACKET_MAX / sizeof(uint32_t)];
+    SockHeader hdr;
+    ssize_t len = recv(fd, reply, sizeof(reply), 0);
+
+    if (len < (ssize_t)sizeof(hdr))
+        die("no reply from snot");
+    memcpy(&hdr, reply, sizeof(hdr));
+    if (hdr.magic != SOCK_MAGIC ||
+        (size_t)len < sizeof(hdr) + hdr.count * sizeof(uint32_t))
+        die("bad reply from snot");
+    for (uint32_t i = 0; i < hdr.count; i++)
+        printf("%u\n", reply[sizeof(hdr) / sizeof(uint32_t) + i]);
+}
+
+int
+main(int argc, char *argv[]) {
+    SockNotify n = { "snot-send", "", NULL, "", 0, -1, 1 };
+    int count = 1, batch = 0, opt, fd, inflight = 0;
+
+    while ((opt = getopt(argc, argv, "a:i:u:t:r:n:b")) != -1) {
+        switch (opt) {
+        case 'a': n.app_name = optarg; break;
+        case 'i': n.app_icon = optarg; break;
+        case 'u': n.urgency = atoi(optarg); break;
+        case 't': n.expire_timeout = atoi(optarg); break;
+        case 'r': n.replaces_id = strtoul(optarg, NULL, 10); break;
+        case 'n': count = atoi(optarg); break;
+        case 'b': batch = 1; break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || count <= 0)
+        usage();
+    n.summary = argv[optind];
+    if (optind + 1 < argc)
+        n.body = argv[optind + 1];
+
+    fd = connect_snot();
+    for (int left = count; left > 0; ) {
+        left -= send_packet(fd, &n, batch ? left : 1);
+        if (++inflight == WINDOW) {
+            read_reply(fd);
+            inflight--;
+        }
+    }
+    while (inflight--)
+        read_reply(fd);
+
+    close(fd);
+    return 0;
+}
@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/select.h>
 #include <sys/mman.h>  
 #include <wayland-client.h>
@@ -12,9 +14,18 @@
 #include <sys/stat.h>
 
 #include "protocols/wlr-layer-shell-unstable-v1-client-protocol.h"
+#include "protocols/presentation-time-client-protocol.h"
 #include "config.h"
 #include "snot.h"
 #include "dbus.h"
+#include "image.h"
+#include "icon.h"
+#include "ratelimit.h"
+#include "sock.h"
+#include "latency.h"
+#include "stats.h"
+#include "log.h"
+#include "probes.h"
 
 
 static struct wl_display *display;
@@ -22,12 +33,67 @@ static struct wl_registry *registry;
 static struct wl_compositor *compositor;
 static struct zwlr_layer_shell_v1 *layer_shell;
 static struct wl_shm *shm;
+static struct wp_presentation *presentation;   /* optional */
+static uint32_t presentation_clock = CLOCK_MONOTONIC;
+static volatile sig_atomic_t dump_latency;
 
 static Notification notifications[MAX_NOTIFICATIONS];
 static int notification_count = 0;
+static uint32_t next_id = 1;
+
+/* ring buffer behind the visible stack; entries hold content only and
+ * get no surface, layout or buffer until they are promoted */
+#define PENDING_SLOTS (PENDING_MAX + PENDING_CRITICAL)
+static Notification pending[PENDING_SLOTS];
+static int pending_head = 0;
+static int pending_count = 0;
+#define PENDING(i) (&pending[(pending_head + (i)) % PENDING_SLOTS])
+static QueueStats queue_stats;
+static RenderStats render_stats;
+static unsigned long burst_deadline;    /* 0: no burst being gathered */
+static unsigned long last_flush;        /* ms of the last flush_burst() mapping */
+
+/* content hash -> id of the notification that last showed it */
+#define DEDUP_SLOTS 64
+static struct {
+    uint32_t hash;
+    uint32_t id;
+    unsigned long stamp;
+} dedup[DEDUP_SLOTS];
+
+/*
+ * Every notification record lives in notifications[] or pending[], so
+ * the string blocks are sized for those plus one in flight. Blocks are
+ * handed out in order until all have been used once, then recycled.
+ */
+#define STRING_BLOCKS (MAX_NOTIFICATIONS + PENDING_SLOTS + 1)
+static char string_pool[STRING_BLOCKS][STRING_BLOCK];
+static char *string_free[STRING_BLOCKS];
+static int string_free_count;
+static int string_used;
+
+/* shm buffers of gone notifications, oldest first, reused for the next
+ * one that fits */
+static struct {
+    struct wl_buffer *buffer;
+    struct wl_shm_pool *shm_pool;
+    cairo_surface_t *target;
+    void *data;
+    size_t size;
+    int width, height;
+    bool busy;                  /* the compositor has not released it yet */
+} buffer_pool[BUFFER_POOL];
+static int buffer_pool_count;
+
+/* one layout per font, shared by measuring and drawing */
+static cairo_t *measure;
+static PangoLayout *text_layout;
+static PangoLayout *badge_layout;
 
 static void draw_notification(Notification *n);
+static void draw_partial(Notification *n);
 static void remove_notification(int index);
+static Notification *find_notification(uint32_t id);
 
 static void
 die(const char *msg) {
@@ -35,6 +101,38 @@ die(const char *msg) {
     exit(1);
 }
 
+/* the sooner of two select() timeouts, -1 meaning none */
+static long
+sooner(long a, long b) {
+    if (a < 0)
+        return b;
+    return b >= 0 && b < a ? b : a;
+}
+
+static void
+set_deadline(Notification *n, unsigned long from) {
+    unsigned long t = n->expire_timeout < 0 ? DURATION : n->expire_timeout;
+    n->deadline = t > 0 ? from + t : 0;
+}
+
+/* records a stage the first time the notification reaches it */
+static void
+trace(Notification *n, int stage) {
+    if (n->traced & 1 << stage)
+        return;
+    n->traced |= 1 << stage;
+    latency_record(stage, n->received);
+}
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *p, uint32_t clk_id) {
+    presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    .clock_id = presentation_clock_id,
+};
+
 static void 
 registry_global(void *data, struct wl_registry *registry,
                             uint32_t name, const char *interface, uint32_t version) {
@@ -47,6 +145,10 @@ registry_global(void *data, struct wl_registry *registry,
     } else if (strcmp(interface, wl_shm_interface.name) == 0) {
         shm = wl_registry_bind(registry, name,
                                &wl_shm_interface, 1);
+    } else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+        presentation = wl_registry_bind(registry, name,
+                                        &wp_presentation_interface, 1);
+        wp_presentation_add_listener(presentation, &presentation_listener, NULL);
     }
 }
 
@@ -60,17 +162,32 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = registry_global_remove,
 };
 
+static void apply_update(Notification *n);
+
 static void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
                        uint32_t serial, uint32_t width, uint32_t height) {
     Notification *n = data;
     
-    printf("Configuring surface with %dx%d\n", width, height);
+    log_debug("Configuring surface with %dx%d\n", width, height);
     
     zwlr_layer_surface_v1_ack_configure(surface, serial);
-    
-    if (!n->configured) {
+    PROBE3(configure, n->id, width, height);
+    trace(n, LAT_CONFIGURE);
+
+    if (!n->configured)
         n->configured = true;
+    else if (n->resize_pending)
+        n->resize_pending = false;
+    else
+        return;
+
+    /* content replaced while waiting for this configure was laid out
+     * for the old text, lay it out again */
+    if (n->update_pending) {
+        n->update_pending = false;
+        apply_update(n);
+    } else {
         draw_notification(n);
     }
 }
@@ -80,6 +197,7 @@ layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surface) {
     Notification *n = data;
     int index = n - notifications;  
     if (index >= 0 && index < notification_count) {
+        dbus_emit_closed(n->id, CLOSE_UNDEFINED);
         remove_notification(index);
     }
 }
@@ -90,51 +208,311 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 };
 
 static void
-create_notification_surface(Notification *n) {
-    printf("Creating notification for: '%s' - '%s'\n", n->summary, n->body);
-
-    int width = NOTIFICATION_WIDTH;
-    int height = NOTIFICATION_HEIGHT;
+buffer_release(void *data, struct wl_buffer *buffer) {
+    Notification *n = data;
 
-    n->surface = wl_compositor_create_surface(compositor);
-    if (!n->surface) {
-        fprintf(stderr, "Failed to create surface\n");
+    if (!n) {
+        /* a pooled buffer the compositor held on to */
+        for (int i = 0; i < buffer_pool_count; i++)
+            if (buffer_pool[i].buffer == buffer)
+                buffer_pool[i].busy = false;
         return;
     }
 
-    n->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-        layer_shell, n->surface, NULL,
-        ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "notification");
-    
-    if (!n->layer_surface) {
-        fprintf(stderr, "Failed to create layer surface\n");
-        wl_surface_destroy(n->surface);
-        return;
+    n->buffer_busy = false;
+    if (n->redraw_pending)
+        draw_notification(n);
+    else if (n->icon_dirty || n->badge_dirty)
+        draw_partial(n);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
+
+static void
+frame_done(void *data, struct wl_callback *cb, uint32_t time) {
+    Notification *n = data;
+
+    wl_callback_destroy(cb);
+    n->frame_cb = NULL;
+    /* without wp_presentation the first frame callback is as close as
+     * we get to the pixels showing up */
+    if (!presentation)
+        trace(n, LAT_PRESENT);
+    /* until the next configure, layer_surface_configure() applies it */
+    if (n->update_pending && n->configured && !n->resize_pending) {
+        n->update_pending = false;
+        apply_update(n);
     }
+}
 
-    n->cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    if (cairo_surface_status(n->cairo_surface) != CAIRO_STATUS_SUCCESS) {
-        fprintf(stderr, "Failed to create Cairo surface\n");
-        zwlr_layer_surface_v1_destroy(n->layer_surface);
-        wl_surface_destroy(n->surface);
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+/* the feedback is keyed by id, the record may have moved or gone */
+static void
+feedback_sync_output(void *data, struct wp_presentation_feedback *fb,
+                     struct wl_output *output) {
+}
+
+static void
+feedback_presented(void *data, struct wp_presentation_feedback *fb,
+                   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+                   uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+                   uint32_t flags) {
+    Notification *n = find_notification((uintptr_t)data);
+    uint64_t at = latency_now();
+
+    if (presentation_clock == CLOCK_MONOTONIC)
+        at = (((uint64_t)tv_sec_hi << 32 | tv_sec_lo) * 1000000 +
+              tv_nsec / 1000);
+    if (n && !(n->traced & 1 << LAT_PRESENT)) {
+        n->traced |= 1 << LAT_PRESENT;
+        latency_record_at(LAT_PRESENT, n->received, at);
+    }
+    wp_presentation_feedback_destroy(fb);
+}
+
+static void
+feedback_discarded(void *data, struct wp_presentation_feedback *fb) {
+    wp_presentation_feedback_destroy(fb);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    .sync_output = feedback_sync_output,
+    .presented = feedback_presented,
+    .discarded = feedback_discarded,
+};
+
+static void
+commit_frame(Notification *n) {
+    if (!n->frame_cb) {
+        n->frame_cb = wl_surface_frame(n->surface);
+        wl_callback_add_listener(n->frame_cb, &frame_listener, n);
+    }
+    if (presentation && !(n->traced & 1 << LAT_COMMIT)) {
+        struct wp_presentation_feedback *fb =
+            wp_presentation_feedback(presentation, n->surface);
+        wp_presentation_feedback_add_listener(fb, &feedback_listener,
+                                              (void *)(uintptr_t)n->id);
+    }
+    wl_surface_commit(n->surface);
+    PROBE1(commit, n->id);
+    trace(n, LAT_COMMIT);
+    n->buffer_busy = true;
+}
+
+static bool
+has_icon(const Notification *n) {
+    return n->image_data.msg || n->icon || n->icon_key;
+}
+
+static void
+free_buffer(struct wl_buffer *buffer, struct wl_shm_pool *shm_pool,
+            cairo_surface_t *target, void *data, size_t size) {
+    cairo_surface_destroy(target);
+    wl_buffer_destroy(buffer);
+    wl_shm_pool_destroy(shm_pool);
+    munmap(data, size);
+    stat_add(&counters.shm_bytes, -(long)size);
+    stat_add(&counters.shm_buffers, -1);
+}
+
+static void
+unpool(int i) {
+    memmove(&buffer_pool[i], &buffer_pool[i + 1],
+            (buffer_pool_count - i - 1) * sizeof(buffer_pool[0]));
+    buffer_pool_count--;
+}
+
+/* takes the smallest idle pooled buffer that fits the notification,
+ * cutting a new wl_buffer from its memory if the size differs */
+static bool
+reuse_buffer(Notification *n, int stride, size_t size) {
+    int best = -1;
+
+    for (int i = 0; i < buffer_pool_count; i++) {
+        if (buffer_pool[i].busy || buffer_pool[i].size < size)
+            continue;
+        if (buffer_pool[i].width == (int)n->width &&
+            buffer_pool[i].height == (int)n->height) {
+            best = i;
+            break;
+        }
+        if (best < 0 || buffer_pool[i].size < buffer_pool[best].size)
+            best = i;
+    }
+    if (best < 0)
+        return false;
+
+    n->buffer = buffer_pool[best].buffer;
+    n->shm_pool = buffer_pool[best].shm_pool;
+    n->target = buffer_pool[best].target;
+    n->shm_data = buffer_pool[best].data;
+    n->shm_size = buffer_pool[best].size;
+    n->buffer_busy = false;
+    if (buffer_pool[best].width != (int)n->width ||
+        buffer_pool[best].height != (int)n->height) {
+        wl_buffer_destroy(n->buffer);
+        cairo_surface_destroy(n->target);
+        n->buffer = wl_shm_pool_create_buffer(n->shm_pool, 0,
+                                              n->width, n->height, stride,
+                                              WL_SHM_FORMAT_ARGB8888);
+        wl_buffer_add_listener(n->buffer, &buffer_listener, n);
+        n->target = cairo_image_surface_create_for_data(n->shm_data,
+                        CAIRO_FORMAT_ARGB32, n->width, n->height, stride);
+    } else {
+        wl_buffer_set_user_data(n->buffer, n);
+    }
+    unpool(best);
+    render_stats.pooled++;
+    return true;
+}
+
+/* one shm buffer per notification, kept for partial redraws */
+static int
+create_buffer(Notification *n) {
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, n->width);
+    int size = stride * n->height;
+
+    if (reuse_buffer(n, stride, size))
+        return 0;
+
+    char tmp[] = "/tmp/snot-XXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create temporary file\n");
+        return -1;
+    }
+    unlink(tmp);
+
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Failed to set file size\n");
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap\n");
+        close(fd);
+        return -1;
+    }
+
+    n->shm_pool = wl_shm_create_pool(shm, fd, size);
+    n->buffer = wl_shm_pool_create_buffer(n->shm_pool, 0,
+                                          n->width, n->height,
+                                          stride,
+                                          WL_SHM_FORMAT_ARGB8888);
+    close(fd);
+
+    wl_buffer_add_listener(n->buffer, &buffer_listener, n);
+    n->shm_data = data;
+    n->shm_size = size;
+    stat_add(&counters.shm_bytes, size);
+    stat_add(&counters.shm_buffers, 1);
+    n->target = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
+                                                    n->width, n->height, stride);
+    n->buffer_busy = false;
+    return 0;
+}
+
+/* parks the buffer in the pool, making room by freeing the oldest idle
+ * one; it is only freed itself if every pooled buffer is still busy */
+static void
+destroy_buffer(Notification *n) {
+    if (!n->buffer)
         return;
+
+    for (int i = 0; buffer_pool_count == BUFFER_POOL && i < BUFFER_POOL; i++) {
+        if (buffer_pool[i].busy)
+            continue;
+        free_buffer(buffer_pool[i].buffer, buffer_pool[i].shm_pool,
+                    buffer_pool[i].target, buffer_pool[i].data,
+                    buffer_pool[i].size);
+        unpool(i);
+        break;
     }
 
-    n->cairo = cairo_create(n->cairo_surface);
-    if (cairo_status(n->cairo) != CAIRO_STATUS_SUCCESS) {
-        fprintf(stderr, "Failed to create Cairo context\n");
-        cairo_surface_destroy(n->cairo_surface);
+    if (buffer_pool_count < BUFFER_POOL) {
+        buffer_pool[buffer_pool_count].buffer = n->buffer;
+        buffer_pool[buffer_pool_count].shm_pool = n->shm_pool;
+        buffer_pool[buffer_pool_count].target = n->target;
+        buffer_pool[buffer_pool_count].data = n->shm_data;
+        buffer_pool[buffer_pool_count].size = n->shm_size;
+        buffer_pool[buffer_pool_count].width = n->width;
+        buffer_pool[buffer_pool_count].height = n->height;
+        buffer_pool[buffer_pool_count].busy = n->buffer_busy;
+        buffer_pool_count++;
+        wl_buffer_set_user_data(n->buffer, NULL);
+    } else {
+        free_buffer(n->buffer, n->shm_pool, n->target, n->shm_data, n->shm_size);
+    }
+    n->buffer = NULL;
+    n->shm_pool = NULL;
+    n->target = NULL;
+    n->shm_data = NULL;
+}
+
+/* the cached layout for font, made current for drawing on cr */
+static PangoLayout *
+get_layout(PangoLayout **layout, const char *font, cairo_t *cr) {
+    if (!*layout) {
+        PangoFontDescription *desc = pango_font_description_from_string(font);
+        *layout = pango_cairo_create_layout(cr);
+        pango_layout_set_font_description(*layout, desc);
+        pango_font_description_free(desc);
+    } else {
+        pango_cairo_update_layout(cr, *layout);
+    }
+    return *layout;
+}
+
+static void
+destroy_notification_surface(Notification *n) {
+    if (n->layer_surface) {
         zwlr_layer_surface_v1_destroy(n->layer_surface);
+        n->layer_surface = NULL;
+    }
+    
+    if (n->surface) {
         wl_surface_destroy(n->surface);
-        return;
+        n->surface = NULL;
     }
 
-    PangoLayout *layout = pango_cairo_create_layout(n->cairo);
-    PangoFontDescription *desc = pango_font_description_from_string(FONT);
-    pango_layout_set_font_description(layout, desc);
-    pango_font_description_free(desc);
+    if (n->frame_cb) {
+        wl_callback_destroy(n->frame_cb);
+        n->frame_cb = NULL;
+    }
 
-    int max_text_width = NOTIFICATION_WIDTH - (2 * PADDING);
+    destroy_buffer(n);
+    n->configured = false;
+    n->update_pending = false;
+    n->resize_pending = false;
+    n->redraw_pending = false;
+    n->icon_dirty = false;
+    n->badge_dirty = false;
+}
+
+/* sizes the notification for its current content */
+static void
+layout_notification(Notification *n) {
+    int width = NOTIFICATION_WIDTH;
+
+    PROBE1(layout_start, n->id);
+    if (!measure) {
+        cairo_surface_t *s = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+        measure = cairo_create(s);
+        cairo_surface_destroy(s);
+    }
+
+    PangoLayout *layout = get_layout(&text_layout, FONT, measure);
+    pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
+
+    int icon_w = has_icon(n) ? ICON_SIZE + PADDING : 0;
+    int max_text_width = NOTIFICATION_WIDTH - (2 * PADDING) - icon_w;
     pango_layout_set_width(layout, max_text_width * PANGO_SCALE);
     pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
 
@@ -145,31 +523,51 @@ create_notification_surface(Notification *n) {
         pango_layout_set_text(layout, n->summary, -1);
         pango_layout_get_pixel_size(layout, &text_width, &text_height);
         total_height = text_height;
-        width = MAX(width, text_width + (2 * PADDING));
+        width = MAX(width, text_width + (2 * PADDING) + icon_w);
     }
 
     if (n->body) {
         pango_layout_set_text(layout, n->body, -1);
         pango_layout_get_pixel_size(layout, &text_width, &text_height);
         total_height += text_height + PADDING;
-        width = MAX(width, text_width + (2 * PADDING));
+        width = MAX(width, text_width + (2 * PADDING) + icon_w);
     }
 
-    g_object_unref(layout);
+    int height = MAX(NOTIFICATION_HEIGHT, total_height + (2 * PADDING));
+    if (icon_w)
+        height = MAX(height, ICON_SIZE + (2 * PADDING));
 
-    height = MAX(NOTIFICATION_HEIGHT, total_height + (2 * PADDING));
-    width = MIN(MAX(NOTIFICATION_WIDTH, width), NOTIFICATION_MAX_WIDTH);
+    n->width = MIN(MAX(NOTIFICATION_WIDTH, width), NOTIFICATION_MAX_WIDTH);
+    n->height = height;
+    PROBE3(layout_end, n->id, n->width, n->height);
+    trace(n, LAT_LAYOUT);
+}
 
-    if (width != NOTIFICATION_WIDTH || height != NOTIFICATION_HEIGHT) {
-        cairo_destroy(n->cairo);
-        cairo_surface_destroy(n->cairo_surface);
-        
-        n->cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-        n->cairo = cairo_create(n->cairo_surface);
+static void
+create_notification_surface(Notification *n) {
+    log_debug("Creating notification for: '%s' - '%s'\n", n->summary, n->body);
+
+    int width, height;
+
+    n->surface = wl_compositor_create_surface(compositor);
+    if (!n->surface) {
+        fprintf(stderr, "Failed to create surface\n");
+        return;
     }
 
-    n->width = width;
-    n->height = height;
+    n->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+        layer_shell, n->surface, NULL,
+        ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "notification");
+    
+    if (!n->layer_surface) {
+        fprintf(stderr, "Failed to create layer surface\n");
+        wl_surface_destroy(n->surface);
+        return;
+    }
+
+    layout_notification(n);
+    width = n->width;
+    height = n->height;
 
     zwlr_layer_surface_v1_add_listener(n->layer_surface,
                                      &layer_surface_listener, n);
@@ -177,23 +575,16 @@ create_notification_surface(Notification *n) {
     zwlr_layer_surface_v1_set_size(n->layer_surface, width, height);
 
     uint32_t anchor = 0;
-    int margin_top = 0;
-    int margin_right = 0;
-    int margin_bottom = 0;
-    int margin_left = 0;
 
     if (POSITION == 0) {  // top
         anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP;
-        margin_top = SPACING;
     } else {  // bottom
         anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM;
-        margin_bottom = SPACING;
     }
 
     switch (ALIGNMENT) {
         case 0:  // left
             anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
-            margin_left = SPACING;
             break;
         case 1:  // center
             anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT | 
@@ -201,44 +592,122 @@ create_notification_surface(Notification *n) {
             break;
         case 2:  // right
             anchor |= ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
-            margin_right = SPACING;
             break;
     }
 
-    int stack_offset = notification_count * (height + SPACING);
-    if (POSITION == 0) {
-        margin_top += stack_offset;
-    } else {
-        margin_bottom += stack_offset;
-    }
-
     zwlr_layer_surface_v1_set_anchor(n->layer_surface, anchor);
-    zwlr_layer_surface_v1_set_margin(n->layer_surface,
-                                    margin_top,
-                                    margin_right,
-                                    margin_bottom,
-                                    margin_left);
-
     zwlr_layer_surface_v1_set_exclusive_zone(n->layer_surface, -1);
 
+    /* margins and the initial commit come from restack() */
     n->configured = false;
+    n->stack_offset = -1;
 
-    wl_surface_commit(n->surface);
+    log_debug("Notification surface created: pos=%s align=%s size=%dx%d\n",
+              POSITION == 0 ? "top" : "bottom",
+              ALIGNMENT == 0 ? "left" : (ALIGNMENT == 1 ? "center" : "right"),
+              width, height);
+}
+
+/*
+ * Places every mapped notification below (or above) the ones before it.
+ * Offsets follow the real heights, and only surfaces whose offset moved
+ * are touched and committed.
+ */
+static void
+restack(void) {
+    int offset = 0;
+
+    for (int i = 0; i < notification_count; i++) {
+        Notification *n = &notifications[i];
+        if (!n->layer_surface)
+            continue;
+
+        if (n->stack_offset != offset) {
+            int margin_top = 0, margin_right = 0;
+            int margin_bottom = 0, margin_left = 0;
+
+            if (POSITION == 0)
+                margin_top = SPACING + offset;
+            else
+                margin_bottom = SPACING + offset;
+            if (ALIGNMENT == 0)
+                margin_left = SPACING;
+            else if (ALIGNMENT == 2)
+                margin_right = SPACING;
+
+            zwlr_layer_surface_v1_set_margin(n->layer_surface,
+                                            margin_top,
+                                            margin_right,
+                                            margin_bottom,
+                                            margin_left);
+            wl_surface_commit(n->surface);
+            n->stack_offset = offset;
+        }
+        offset += n->height + SPACING;
+    }
+}
+
+static void
+paint_icon(cairo_t *cr, Notification *n) {
+    if (!n->icon)
+        return;
+    cairo_set_source_surface(cr, n->icon, PADDING, (n->height - ICON_SIZE) / 2);
+    cairo_paint(cr);
+}
 
-    printf("Notification surface created: pos=%s align=%s size=%dx%d offset=%d\n",
-           POSITION == 0 ? "top" : "bottom",
-           ALIGNMENT == 0 ? "left" : (ALIGNMENT == 1 ? "center" : "right"),
-           width, height, stack_offset);
+/* "×N" in the top right corner, inside the border */
+static void
+badge_rect(const Notification *n, int *x, int *y, int *w, int *h) {
+    *w = BADGE_WIDTH;
+    *h = PADDING - BORDER_WIDTH;
+    *x = n->width - BORDER_WIDTH - *w;
+    *y = BORDER_WIDTH;
+}
+
+static void
+paint_badge(cairo_t *cr, Notification *n) {
+    int x, y, w, h, tw, th;
+    char text[16];
+
+    if (n->repeat < 2)
+        return;
+    badge_rect(n, &x, &y, &w, &h);
+    snprintf(text, sizeof(text), "\u00d7%d", n->repeat);
+
+    PangoLayout *layout = get_layout(&badge_layout, BADGE_FONT, cr);
+    pango_layout_set_text(layout, text, -1);
+    pango_layout_get_pixel_size(layout, &tw, &th);
+
+    cairo_set_source_rgb(cr, 0.733, 0.733, 0.733);
+    cairo_move_to(cr, x + w - tw - BORDER_WIDTH, y + (h - th) / 2);
+    pango_cairo_show_layout(cr, layout);
 }
 
 static void
 draw_notification(Notification *n) {
+    if (!n->buffer && create_buffer(n) < 0)
+        return;
+    if (n->buffer_busy) {
+        n->redraw_pending = true;
+        return;
+    }
+    n->redraw_pending = false;
+    n->icon_dirty = false;
+    n->badge_dirty = false;
+
+    uint64_t start = latency_now();
+    PROBE2(raster_start, n->id, 0);
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, n->width);
+    int icon_w = has_icon(n) ? ICON_SIZE + PADDING : 0;
+    void *data = n->shm_data;
 
-    if (!n->cairo || !n->cairo_surface) {
-        fprintf(stderr, "No cairo surface available\n");
+    /* render straight into the shm buffer */
+    cairo_t *cr = cairo_create(n->target);
+    if (cairo_status(cr) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Failed to create Cairo context\n");
+        cairo_destroy(cr);
         return;
     }
-    cairo_t *cr = n->cairo;
 
     cairo_save(cr);
     cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
@@ -253,11 +722,7 @@ draw_notification(Notification *n) {
     cairo_rectangle(cr, 0, 0, n->width, n->height);
     cairo_stroke(cr);
     
-    PangoLayout *layout = pango_cairo_create_layout(cr);
-    PangoFontDescription *desc = pango_font_description_from_string(FONT);
-    pango_layout_set_font_description(layout, desc);
-    pango_font_description_free(desc);
-
+    PangoLayout *layout = get_layout(&text_layout, FONT, cr);
     pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
 
     int total_height = 0;
@@ -265,7 +730,7 @@ draw_notification(Notification *n) {
     int body_height = 0;
     int text_width;
 
-    pango_layout_set_width(layout, (n->width - 2 * PADDING) * PANGO_SCALE);
+    pango_layout_set_width(layout, (n->width - 2 * PADDING - icon_w) * PANGO_SCALE);
     pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
 
     if (n->summary) {
@@ -283,110 +748,724 @@ draw_notification(Notification *n) {
     int y_offset = (n->height - total_height) / 2;
 
     if (n->summary) {
-        printf("Drawing summary: %s\n", n->summary);
+        log_debug("Drawing summary: %s\n", n->summary);
         cairo_set_source_rgb(cr, 0.733, 0.733, 0.733);
         pango_layout_set_text(layout, n->summary, -1);
-        cairo_move_to(cr, PADDING, y_offset);
+        cairo_move_to(cr, PADDING + icon_w, y_offset);
         pango_cairo_show_layout(cr, layout);
     }
 
     if (n->body) {
-        printf("Drawing body: %s\n", n->body);
+        log_debug("Drawing body: %s\n", n->body);
         pango_layout_set_text(layout, n->body, -1);
-        cairo_move_to(cr, PADDING, y_offset + summary_height + (PADDING/2));
+        cairo_move_to(cr, PADDING + icon_w, y_offset + summary_height + (PADDING/2));
         pango_cairo_show_layout(cr, layout);
     }
 
-    g_object_unref(layout);
+    paint_icon(cr, n);
+    paint_badge(cr, n);
 
-    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, n->width);
-    int size = stride * n->height;
+    cairo_destroy(cr);
+    cairo_surface_flush(n->target);
 
-    char tmp[] = "/tmp/snot-XXXXXX";
-    int fd = mkstemp(tmp);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to create temporary file\n");
+    /* image-data pixels go from the message into the buffer in one pass */
+    ImageData img;
+    if (n->image_data.msg && hint_get_image(&n->image_data, &img) == 0) {
+        uint8_t *box = (uint8_t *)data + ((n->height - ICON_SIZE) / 2) * stride
+                       + PADDING * 4;
+        image_blit(&img, box, stride, ICON_SIZE, ICON_SIZE);
+        cairo_surface_mark_dirty(n->target);
+    }
+    PROBE2(raster_end, n->id, 0);
+    trace(n, LAT_RASTER);
+
+    wl_surface_attach(n->surface, n->buffer, 0, 0);
+    wl_surface_damage_buffer(n->surface, 0, 0, n->width, n->height);
+    commit_frame(n);
+    stat_add(&counters.rendered, 1);
+    latency_record(LAT_DRAW, start);
+
+    log_debug("Drawing complete\n");
+}
+
+/* repaints only the regions marked dirty and damages just those */
+static void
+draw_partial(Notification *n) {
+    if (!n->buffer || n->buffer_busy)
+        return;     /* the flags stay set for buffer_release() */
+
+    PROBE2(raster_start, n->id, 1);
+    cairo_t *cr = cairo_create(n->target);
+
+    if (n->icon_dirty) {
+        int y = (n->height - ICON_SIZE) / 2;
+
+        cairo_save(cr);
+        cairo_rectangle(cr, PADDING, y, ICON_SIZE, ICON_SIZE);
+        cairo_clip(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_rgba(cr, 0.133, 0.133, 0.133, 0.9);
+        cairo_paint(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+        paint_icon(cr, n);
+        cairo_restore(cr);
+        wl_surface_damage_buffer(n->surface, PADDING, y, ICON_SIZE, ICON_SIZE);
+    }
+
+    if (n->badge_dirty) {
+        int x, y, w, h;
+
+        badge_rect(n, &x, &y, &w, &h);
+        cairo_save(cr);
+        cairo_rectangle(cr, x, y, w, h);
+        cairo_clip(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_rgba(cr, 0.133, 0.133, 0.133, 0.9);
+        cairo_paint(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+        paint_badge(cr, n);
+        cairo_restore(cr);
+        wl_surface_damage_buffer(n->surface, x, y, w, h);
+    }
+
+    n->icon_dirty = false;
+    n->badge_dirty = false;
+
+    cairo_destroy(cr);
+    cairo_surface_flush(n->target);
+    PROBE2(raster_end, n->id, 1);
+
+    wl_surface_attach(n->surface, n->buffer, 0, 0);
+    commit_frame(n);
+    render_stats.partial++;
+}
+
+void
+icon_loaded(const char *icon, int size, int scale, cairo_surface_t *surface) {
+    if (size != ICON_SIZE || scale != 1)
         return;
+
+    for (int i = 0; i < notification_count; i++) {
+        Notification *n = &notifications[i];
+        if (!n->icon_key || strcmp(n->icon_key, icon) != 0)
+            continue;
+
+        n->icon_key = NULL;
+        n->icon = surface ? cairo_surface_reference(surface) : NULL;
+        n->icon_dirty = true;
+        if (n->configured)
+            draw_partial(n);
     }
-    unlink(tmp);
+}
 
-    if (ftruncate(fd, size) < 0) {
-        fprintf(stderr, "Failed to set file size\n");
-        close(fd);
+static char *
+string_block_get(size_t len) {
+    if (len > STRING_BLOCK) {
+        render_stats.oversize++;
+        return malloc(len);
+    }
+    if (string_free_count)
+        return string_free[--string_free_count];
+    if (string_used < STRING_BLOCKS)
+        return string_pool[string_used++];
+    return malloc(len);
+}
+
+static void
+string_block_put(char *p) {
+    if (p >= string_pool[0] && p < string_pool[STRING_BLOCKS])
+        string_free[string_free_count++] = p;
+    else
+        free(p);
+}
+
+static void
+free_notification(Notification *n) {
+    string_block_put(n->strings);
+    n->strings = NULL;
+    lazy_hint_release(&n->image_data);
+    if (n->icon)
+        cairo_surface_destroy(n->icon);
+    n->icon = NULL;
+    n->icon_key = NULL;
+}
+
+/*
+ * Copies every string of a notification into one block, so content
+ * costs one pooled block however many fields are set. Only text longer
+ * than STRING_BLOCK goes to malloc.
+ */
+static void
+set_strings(Notification *n, const char *summary, const char *body,
+            const char *app_name, const char *category, const char *icon_src) {
+    const char *src[] = { summary, body, app_name, category, icon_src };
+    char **dst[] = { &n->summary, &n->body, &n->app_name, &n->category,
+                     &n->icon_src };
+    size_t len[5], total = 0;
+
+    for (int i = 0; i < 5; i++) {
+        len[i] = src[i] ? strlen(src[i]) + 1 : 0;
+        total += len[i];
+    }
+
+    char *p = n->strings = total ? string_block_get(total) : NULL;
+    for (int i = 0; i < 5; i++) {
+        *dst[i] = NULL;
+        if (!src[i] || !p)
+            continue;
+        memcpy(p, src[i], len[i]);
+        *dst[i] = p;
+        p += len[i];
+    }
+}
+
+static void
+set_content(Notification *n, const char *summary, const char *body,
+            const char *app_name, const char *app_icon,
+            int32_t expire_timeout, const Hints *hints) {
+    /* pixels stay in the message until the renderer asks for them */
+    lazy_hint_retain(&n->image_data, &hints->image_data);
+    /* image-data beats image-path beats app_icon */
+    const char *src = hints->image_path ? hints->image_path : app_icon;
+    if (n->image_data.msg || !src || !*src)
+        src = NULL;
+    set_strings(n, summary, body, app_name, hints->category, src);
+    n->urgency = hints->urgency;
+    n->value = hints->value;
+    n->collapsed = 0;
+    n->repeat = 1;
+    n->expire_timeout = expire_timeout;
+    n->opacity = 1.0;
+    /* a queued notification expires on its arrival time; showing it
+     * restarts the clock */
+    set_deadline(n, latency_now_ms());
+}
+
+/* an icon that still has to be decoded gets its slot now and is painted
+ * in when it is ready */
+static void
+resolve_icon(Notification *n) {
+    n->icon = NULL;
+    n->icon_key = NULL;
+    if (n->icon_src &&
+        icon_cache_get(n->icon_src, ICON_SIZE, 1, &n->icon) == ICON_PENDING)
+        n->icon_key = n->icon_src;
+}
+
+/*
+ * A notification that just got a visible slot. Its surface is not made
+ * here: everything that arrives within one BURST_WINDOW is mapped by a
+ * single flush_burst() pass. A lone one, arriving with no burst open and
+ * none flushed within the last BURST_WINDOW, does not wait for company.
+ */
+static void
+show_notification(Notification *n) {
+    resolve_icon(n);
+    n->start_time = latency_now_ms();
+    set_deadline(n, n->start_time);
+
+    /* critical and lone ones go out on this loop pass, low ones wait
+     * longer so more of them share a pass */
+    unsigned long due = n->start_time;
+    bool lone = !burst_deadline && n->start_time - last_flush >= BURST_WINDOW;
+    if (!lone && n->urgency == URGENCY_LOW)
+        due += BURST_WINDOW_LOW;
+    else if (!lone && n->urgency != URGENCY_CRITICAL)
+        due += BURST_WINDOW;
+    if (!burst_deadline || due < burst_deadline)
+        burst_deadline = due;
+}
+
+/*
+ * Maps the notifications gathered since the burst window opened: one
+ * layout pass, one restack, one flush. Returns the ms until the window
+ * closes, or -1 if no burst is open.
+ */
+static long
+flush_burst(void) {
+    unsigned long now = latency_now_ms();
+    int mapped = 0;
+
+    if (!burst_deadline)
+        return -1;
+    if (now < burst_deadline)
+        return burst_deadline - now;
+    burst_deadline = 0;
+
+    /* most urgent first, so their configures come back first */
+    for (int u = URGENCY_CRITICAL; u >= URGENCY_LOW; u--) {
+        for (int i = 0; i < notification_count; i++) {
+            Notification *n = &notifications[i];
+            if (n->surface || n->urgency != u)
+                continue;
+            create_notification_surface(n);
+            mapped++;
+        }
+    }
+    if (!mapped)
+        return -1;
+
+    restack();
+    wl_display_flush(display);
+    last_flush = now;
+    render_stats.bursts++;
+    render_stats.batched += mapped;
+    return -1;
+}
+
+/* relayout and redraw with whatever content is newest */
+static void
+apply_update(Notification *n) {
+    uint32_t width = n->width, height = n->height;
+
+    layout_notification(n);
+    if (n->width == width && n->height == height) {
+        draw_notification(n);
         return;
     }
 
-    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        fprintf(stderr, "Failed to mmap\n");
-        close(fd);
+    /* the new size only takes effect with the next configure */
+    destroy_buffer(n);
+    n->resize_pending = true;
+    zwlr_layer_surface_v1_set_size(n->layer_surface, n->width, n->height);
+    wl_surface_commit(n->surface);
+    restack();
+}
+
+/*
+ * Replacements land here. Content is swapped right away, but at most one
+ * relayout and redraw happens per compositor frame: while a frame
+ * callback is outstanding the update is only marked and frame_done()
+ * applies the newest content. Before the first configure, or while a
+ * resize waits for one, the configure applies it instead.
+ */
+static void
+update_notification(Notification *n) {
+    stat_add(&counters.replaced, 1);
+    resolve_icon(n);
+    n->start_time = latency_now_ms();
+    set_deadline(n, n->start_time);
+
+    if (!n->configured || n->resize_pending) {
+        n->update_pending = true;
         return;
     }
+    if (n->frame_cb) {
+        if (n->update_pending)
+            render_stats.coalesced++;
+        n->update_pending = true;
+        return;
+    }
+    apply_update(n);
+}
 
-    memcpy(data, cairo_image_surface_get_data(n->cairo_surface), size);
+static Notification *
+find_pending(uint32_t id) {
+    for (int i = 0; i < pending_count; i++) {
+        Notification *n = &pending[(pending_head + i) % PENDING_SLOTS];
+        if (n->id == id)
+            return n;
+    }
+    return NULL;
+}
 
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0,
-                                                       n->width, n->height,
-                                                       stride,
-                                                       WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
-    close(fd);
+/* folds n and the newest queued entry into a single "+N more" entry */
+static void
+collapse_pending(Notification *n) {
+    Notification *tail = &pending[(pending_head + pending_count - 1) % PENDING_SLOTS];
+    int count = (tail->collapsed ? tail->collapsed : 1) + 1;
+    char summary[32];
+
+    dbus_emit_closed(n->id, CLOSE_UNDEFINED);
+    free_notification(n);
+    stat_add(&counters.dropped, tail->collapsed ? 1 : 2);
+    /* the entry is new to clients: the tail's id was closed with it */
+    if (!tail->collapsed) {
+        dbus_emit_closed(tail->id, CLOSE_UNDEFINED);
+        tail->id = next_id++;
+    }
+    free_notification(tail);
+
+    snprintf(summary, sizeof(summary), "+%d more", count);
+    set_strings(tail, summary, NULL, "snot", NULL, NULL);
+    tail->urgency = URGENCY_NORMAL;
+    tail->value = -1;
+    tail->expire_timeout = -1;
+    tail->collapsed = count;
+    set_deadline(tail, latency_now_ms());
+}
 
-    wl_surface_attach(n->surface, buffer, 0, 0);
-    wl_surface_damage_buffer(n->surface, 0, 0, n->width, n->height);
-    wl_surface_commit(n->surface);
+/* drops the queued entry at position i */
+static void
+drop_pending(int i) {
+    Notification *n = PENDING(i);
+
+    if (!n->collapsed)
+        dbus_emit_closed(n->id, CLOSE_UNDEFINED);
+    free_notification(n);
+    for (; i < pending_count - 1; i++)
+        *PENDING(i) = *PENDING(i + 1);
+    pending_count--;
+    stat_add(&counters.dropped, 1);
+}
 
-    wl_buffer_destroy(buffer);
-    munmap(data, size);
+/* turns n away instead of queueing it */
+static void
+refuse_pending(Notification *n) {
+    dbus_emit_closed(n->id, CLOSE_UNDEFINED);
+    free_notification(n);
+    stat_add(&counters.dropped, 1);
+}
+
+/*
+ * The queue is kept in urgency order, first come first served within
+ * one urgency, so promotion always takes the most urgent entry. Overflow
+ * policies only ever act on the least urgent entries, and a critical
+ * notification is never what gets dropped: once PENDING_MAX are queued
+ * and all of them are critical, anything else is turned away and a
+ * critical one takes one of the PENDING_CRITICAL extra slots. Only when
+ * those are used up too is a critical newcomer refused.
+ */
+static void
+enqueue_pending(Notification *n) {
+    if (pending_count >= PENDING_MAX &&
+        PENDING(pending_count - 1)->urgency == URGENCY_CRITICAL) {
+        if (n->urgency != URGENCY_CRITICAL || pending_count == PENDING_SLOTS) {
+            refuse_pending(n);
+            return;
+        }
+    } else if (pending_count == PENDING_MAX &&
+               n->urgency > PENDING(pending_count - 1)->urgency) {
+        drop_pending(pending_count - 1);
+    } else if (pending_count == PENDING_MAX) {
+        uint8_t least = PENDING(pending_count - 1)->urgency;
+        int oldest = pending_count - 1;
+
+        switch (QUEUE_POLICY) {
+        case QUEUE_DROP_NEWEST:
+            refuse_pending(n);
+            return;
+        case QUEUE_DROP_OLDEST:
+            while (oldest > 0 && PENDING(oldest - 1)->urgency == least)
+                oldest--;
+            drop_pending(oldest);
+            break;
+        case QUEUE_COLLAPSE:
+            collapse_pending(n);
+            return;
+        }
+    }
 
-    printf("Drawing complete\n");
+    int i = pending_count++;
+    for (; i > 0 && PENDING(i - 1)->urgency < n->urgency; i--)
+        *PENDING(i) = *PENDING(i - 1);
+    *PENDING(i) = *n;
+    stat_add(&counters.queued, 1);
+    queue_stats.depth = pending_count;
+    PROBE2(enqueue, n->id, pending_count);
 }
 
-void
-add_notification(const char *summary, const char *body,
-                const char *app_name, uint32_t replaces_id,
-                uint32_t expire_timeout) {
+static void
+promote_pending(void) {
+    while (notification_count < MAX_NOTIFICATIONS && pending_count > 0) {
+        Notification *n = &notifications[notification_count++];
+        *n = pending[pending_head];
+        pending_head = (pending_head + 1) % PENDING_SLOTS;
+        pending_count--;
+        queue_stats.promoted++;
+        PROBE2(dequeue, n->id, pending_count);
+        show_notification(n);
+    }
+    queue_stats.depth = pending_count;
+}
+
+static void unlink_notification(int index);
+
+/*
+ * Hands the slot of the oldest low urgency notification on screen to a
+ * critical one when the stack is full. The low one goes back to the
+ * queue and is shown again once there is room.
+ */
+static bool
+demote_low(void) {
+    for (int i = 0; i < notification_count; i++) {
+        if (notifications[i].urgency != URGENCY_LOW)
+            continue;
+
+        destroy_notification_surface(&notifications[i]);
+        Notification tmp = notifications[i];
+        unlink_notification(i);
+        if (tmp.icon)
+            cairo_surface_destroy(tmp.icon);
+        tmp.icon = NULL;
+        tmp.icon_key = NULL;
+        tmp.buffer_busy = false;
+        enqueue_pending(&tmp);
+        queue_stats.demoted++;
+        return true;
+    }
+    return false;
+}
+
+static Notification *
+find_notification(uint32_t id) {
+    for (int i = 0; i < notification_count; i++)
+        if (notifications[i].id == id)
+            return &notifications[i];
+    return find_pending(id);
+}
+
+/* gives tmp a slot on screen, or a place in the queue */
+static uint32_t
+insert_notification(Notification *tmp) {
+    Notification *n;
+
+    if (notification_count >= MAX_NOTIFICATIONS &&
+        (tmp->urgency != URGENCY_CRITICAL || !demote_low())) {
+        enqueue_pending(tmp);
+        return tmp->id;
+    }
+
+    n = &notifications[notification_count++];
+    *n = *tmp;
+    show_notification(n);
+    return n->id;
+}
+
+static void
+set_aggregate(Notification *n, const RateSender *s, const char *latest) {
+    char summary[96];
+
+    snprintf(summary, sizeof(summary), "%d more from %s", s->agg_count,
+             s->app[0] ? s->app : "unknown");
+    set_strings(n, summary, latest, s->app, NULL, NULL);
+    n->urgency = URGENCY_NORMAL;
+    n->value = -1;
+    n->expire_timeout = -1;
+}
+
+/*
+ * A notification from a sender that is out of tokens is not shown on its
+ * own. It is counted into that sender's "N more from <app>" entry, which
+ * is updated in place while it is still around and recreated otherwise.
+ */
+static uint32_t
+aggregate_notification(RateSender *s, uint32_t id, const char *summary) {
+    Notification *n = s->agg_id ? find_notification(s->agg_id) : NULL;
+
+    dbus_emit_closed(id, CLOSE_UNDEFINED);
+
+    if (n) {
+        s->agg_count++;
+        free_notification(n);
+        set_aggregate(n, s, summary);
+        if (n >= notifications && n < notifications + notification_count)
+            update_notification(n);
+        else
+            set_deadline(n, latency_now_ms());
+        return id;
+    }
+
+    Notification tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.id = next_id++;
+    tmp.width = NOTIFICATION_WIDTH;
+    tmp.height = NOTIFICATION_HEIGHT;
+    s->agg_count = 1;
+    s->agg_id = tmp.id;
+    set_aggregate(&tmp, s, summary);
+    set_deadline(&tmp, latency_now_ms());
+    insert_notification(&tmp);
+    return id;
+}
+
+static uint32_t
+dedup_hash(const char *app_name, const char *summary, const char *body) {
+    const char *field[3] = { app_name, summary, body };
+    uint32_t h = 2166136261u;
+
+    for (int i = 0; i < 3; i++) {
+        if (!(DEDUP_KEY & (1 << i)))
+            continue;
+        for (const char *p = field[i] ? field[i] : ""; *p; p++)
+            h = (h ^ (unsigned char)*p) * 16777619u;
+        h = (h ^ 0xff) * 16777619u;     /* field separator */
+    }
+    return h;
+}
+
+static bool
+same_field(const char *a, const char *b) {
+    return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+/*
+ * Content that was seen within DEDUP_WINDOW ms and is still around, on
+ * screen or queued, is not shown again: the existing notification gets a
+ * new deadline and a higher "×N" count instead.
+ */
+static Notification *
+dedup_find(uint32_t h, const char *app_name, const char *summary,
+           const char *body, unsigned long now) {
+    Notification *n;
+    int slot = h % DEDUP_SLOTS;
+
+    if (!DEDUP_KEY || dedup[slot].hash != h || !dedup[slot].id ||
+        now - dedup[slot].stamp > DEDUP_WINDOW)
+        return NULL;
+    if (!(n = find_notification(dedup[slot].id)) || n->collapsed)
+        return NULL;
+    if (((DEDUP_KEY & DEDUP_APP) && !same_field(n->app_name, app_name)) ||
+        ((DEDUP_KEY & DEDUP_SUMMARY) && !same_field(n->summary, summary)) ||
+        ((DEDUP_KEY & DEDUP_BODY) && !same_field(n->body, body)))
+        return NULL;
+    dedup[slot].stamp = now;
+    return n;
+}
+
+static void
+dedup_record(uint32_t h, uint32_t id, unsigned long now) {
+    int slot = h % DEDUP_SLOTS;
+
+    dedup[slot].hash = h;
+    dedup[slot].id = id;
+    dedup[slot].stamp = now;
+}
+
+/* replaces, folds, rate limits or inserts; returns the id it ends up as */
+static uint32_t
+admit_notification(const char *summary, const char *body,
+                   const char *app_name, const char *app_icon,
+                   uint32_t replaces_id,
+                   int32_t expire_timeout, const Hints *hints,
+                   uint32_t pid) {
     Notification *n;
-    
-    printf("Received notification: '%s' - '%s'\n", summary, body);
 
     /* Handle replacement if applicable */
     if (replaces_id > 0) {
         for (int i = 0; i < notification_count; i++) {
-            if (notifications[i].replaces_id == replaces_id) {
+            if (notifications[i].id == replaces_id) {
                 n = &notifications[i];
-                free(n->summary);
-                free(n->body);
-                free(n->app_name);
-                goto replace;
+                free_notification(n);
+                set_content(n, summary, body, app_name, app_icon,
+                            expire_timeout, hints);
+                update_notification(n);
+                return replaces_id;
             }
         }
+
+        if ((n = find_pending(replaces_id))) {
+            free_notification(n);
+            set_content(n, summary, body, app_name, app_icon,
+                        expire_timeout, hints);
+            return replaces_id;
+        }
     }
 
-    if (notification_count >= MAX_NOTIFICATIONS)
-        return;
-    n = &notifications[notification_count++];
+    unsigned long now = latency_now_ms();
+    uint32_t h = dedup_hash(app_name, summary, body);
+    if (hints->urgency != URGENCY_CRITICAL &&
+        (n = dedup_find(h, app_name, summary, body, now))) {
+        n->repeat++;
+        set_deadline(n, now);
+        queue_stats.deduped++;
+        n->badge_dirty = true;
+        if (n->configured)
+            draw_partial(n);
+        return n->id;
+    }
 
-    n->surface = NULL;
-    n->layer_surface = NULL;
-    n->cairo_surface = NULL;
-    n->cairo = NULL;
-    n->configured = false;
-    n->width = NOTIFICATION_WIDTH;
-    n->height = NOTIFICATION_HEIGHT;
+    /* critical notifications are never held back */
+    RateSender *s = ratelimit_get(app_name, pid, now);
+    if (hints->urgency != URGENCY_CRITICAL && !ratelimit_take(s, now))
+        return aggregate_notification(s, next_id++, summary);
+
+    Notification tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.id = next_id++;
+    tmp.width = NOTIFICATION_WIDTH;
+    tmp.height = NOTIFICATION_HEIGHT;
+    tmp.received = latency_received();
+    set_content(&tmp, summary, body, app_name, app_icon, expire_timeout, hints);
+    dedup_record(h, tmp.id, now);
+    return insert_notification(&tmp);
+}
 
-replace:
+uint32_t
+add_notification(const char *summary, const char *body,
+                const char *app_name, const char *app_icon,
+                uint32_t replaces_id,
+                int32_t expire_timeout, const Hints *hints,
+                uint32_t pid) {
+    log_debug("Received notification: '%s' - '%s'\n", summary, body);
+    stat_add(&counters.received, 1);
+
+    uint32_t id = admit_notification(summary, body, app_name, app_icon,
+                                     replaces_id, expire_timeout, hints, pid);
+    PROBE3(notify, id, app_name, body ? strlen(body) : 0);
+    return id;
+}
 
-    n->summary = summary ? strdup(summary) : NULL;
-    n->body = body ? strdup(body) : NULL;
-    n->app_name = app_name ? strdup(app_name) : NULL;
-    n->replaces_id = replaces_id;
-    n->expire_timeout = expire_timeout;
-    n->start_time = time(NULL) * 1000;
-    n->opacity = 1.0;
+const RenderStats *
+render_get_stats(void) {
+    return &render_stats;
+}
 
-    create_notification_surface(n);
+/*
+ * Retires everything past its deadline and returns the ms until the next
+ * one, or -1 if nothing is scheduled. Queued entries go first so a slot
+ * freed below is never handed to one that is already out of time.
+ */
+static long
+expire_notifications(void) {
+    unsigned long now = latency_now_ms();
+    unsigned long next = 0;
+    int kept = 0;
+
+    for (int i = 0; i < pending_count; i++) {
+        Notification *n = &pending[(pending_head + i) % PENDING_SLOTS];
+        if (n->deadline && now >= n->deadline) {
+            PROBE2(expire, n->id, 1);
+            dbus_emit_closed(n->id, CLOSE_EXPIRED);
+            free_notification(n);
+            queue_stats.expired++;
+            continue;
+        }
+        if (n->deadline && (!next || n->deadline < next))
+            next = n->deadline;
+        if (kept != i)
+            pending[(pending_head + kept) % PENDING_SLOTS] = *n;
+        kept++;
+    }
+    pending_count = kept;
+    queue_stats.depth = pending_count;
+
+    for (int i = 0; i < notification_count; i++) {
+        Notification *n = &notifications[i];
+        if (!n->deadline)
+            continue;
+
+        /* one still waiting for its first configure goes without ever
+         * being rendered */
+        if (now >= n->deadline) {
+            log_debug("Removing expired notification %d\n", i);
+            PROBE2(expire, n->id, 0);
+            if (!n->configured)
+                queue_stats.expired++;
+            dbus_emit_closed(n->id, CLOSE_EXPIRED);
+            remove_notification(i--);
+            continue;
+        }
+        if (!next || n->deadline < next)
+            next = n->deadline;
+    }
+
+    return next ? (long)(next - now) : -1;
+}
+
+const QueueStats *
+queue_get_stats(void) {
+    return &queue_stats;
 }
 
 static void
@@ -427,47 +1506,67 @@ remove_notification(int index) {
     if (index < 0 || index >= notification_count)
         return;
 
-    Notification *n = &notifications[index];
-
-    if (n->layer_surface) {
-        zwlr_layer_surface_v1_destroy(n->layer_surface);
-        n->layer_surface = NULL;
-    }
-    
-    if (n->surface) {
-        wl_surface_destroy(n->surface);
-        n->surface = NULL;
-    }
-
-    if (n->cairo) {
-        cairo_destroy(n->cairo);
-        n->cairo = NULL;
-    }
-    
-    if (n->cairo_surface) {
-        cairo_surface_destroy(n->cairo_surface);
-        n->cairo_surface = NULL;
-    }
+    PROBE1(remove, notifications[index].id);
+    destroy_notification_surface(&notifications[index]);
+    free_notification(&notifications[index]);
+    unlink_notification(index);
+    promote_pending();
+    restack();
+}
 
-    free(n->summary);
-    free(n->body);
-    free(n->app_name);
+/* closes the gap at index in notifications[] */
+static void
+unlink_notification(int index) {
+    Notification *n;
 
     for (int i = index; i < notification_count - 1; i++) {
         notifications[i] = notifications[i + 1];
+        /* listeners were registered with the old slot address */
+        n = &notifications[i];
+        if (n->layer_surface)
+            zwlr_layer_surface_v1_set_user_data(n->layer_surface, n);
+        if (n->buffer)
+            wl_buffer_set_user_data(n->buffer, n);
+        if (n->frame_cb)
+            wl_callback_set_user_data(n->frame_cb, n);
     }
 
     notification_count--;
 }
 
+static void
+handle_usr1(int sig) {
+    dump_latency = 1;
+}
+
+/* through the log ring like everything else, so a full stdout does not
+ * stall the loop */
+static void
+log_latency(void) {
+    LatencySummary s;
+
+    log_info("%-10s %8s %10s %10s %10s %10s (us)\n",
+             "stage", "count", "p50", "p90", "p99", "max");
+    for (int i = 0; i < LAT_COUNT; i++) {
+        latency_summary(i, &s);
+        log_info("%-10s %8lu %10llu %10llu %10llu %10llu\n",
+                 latency_stage_name(i), s.count,
+                 (unsigned long long)s.p50, (unsigned long long)s.p90,
+                 (unsigned long long)s.p99, (unsigned long long)s.max);
+    }
+}
+
 int
 main(void) {
+    struct sigaction sa = { .sa_handler = handle_usr1 };
+
+    log_init(STDOUT_FILENO);
 
     display = wl_display_connect(NULL);
     if (!display)
         die("Cannot connect to Wayland display");
 
-    printf("Connected to Wayland display\n");
+    log_info("Connected to Wayland display\n");
 
     registry = wl_display_get_registry(display);
     wl_registry_add_listener(registry, &registry_listener, NULL);
@@ -475,14 +1574,30 @@ main(void) {
 
     if (!compositor || !layer_shell || !shm)
         die("Missing required Wayland protocols");
+    if (!presentation)
+        log_info("No wp_presentation, timing presentation by frame callbacks\n");
 
-    printf("Wayland protocols initialized\n");
+    log_info("Wayland protocols initialized\n");
 
     if (dbus_init() < 0)
         die("Failed to initialize D-Bus");
 
-    printf("D-Bus initialized\n");
+    log_info("D-Bus initialized\n");
+
+    if (icon_cache_init() < 0)
+        die("Failed to start icon decoder");
+
+    /* the D-Bus path keeps working without it */
+    if (sock_init() == 0)
+        log_info("Listening on local socket\n");
 
+    if (stats_init() == 0)
+        log_info("Serving stats on " STATS_SOCKET_NAME "\n");
+
+    /* no SA_RESTART, so select() wakes up to print the histograms */
+    sigaction(SIGUSR1, &sa, NULL);
+
+long timeout = -1;
 while (1) {
 
     while (wl_display_prepare_read(display) != 0) {
@@ -492,23 +1607,42 @@ while (1) {
 
     int wayland_fd = wl_display_get_fd(display);
     
-    fd_set read_fds;
+    fd_set read_fds, write_fds;
     FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
     FD_SET(wayland_fd, &read_fds);
 
+    int icon_fd = icon_cache_get_fd();
+    FD_SET(icon_fd, &read_fds);
+
+    int maxfd = MAX(MAX(wayland_fd, icon_fd), dbus_prepare(&read_fds, &write_fds));
+    maxfd = MAX(maxfd, sock_prepare(&read_fds, &write_fds));
+    maxfd = MAX(maxfd, stats_prepare(&read_fds));
+    maxfd = MAX(maxfd, log_prepare(&write_fds));
+
     struct timeval tv = {
-        .tv_sec = 0,
-        .tv_usec = 16666  
+        .tv_sec = timeout / 1000,
+        .tv_usec = (timeout % 1000) * 1000
     };
 
-    int ret = select(wayland_fd + 1, &read_fds, NULL, NULL, &tv);
+    int ret = select(maxfd + 1, &read_fds, &write_fds, NULL,
+                     timeout < 0 ? NULL : &tv);
 
     if (ret < 0 && errno != EINTR) {
         fprintf(stderr, "select failed: %s\n", strerror(errno));
         break;
     }
+    if (ret <= 0) {
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+    }
+    stats_wakeup();
+    if (dump_latency) {
+        dump_latency = 0;
+        log_latency();
+    }
 
-    if (ret > 0 && FD_ISSET(wayland_fd, &read_fds)) {
+    if (FD_ISSET(wayland_fd, &read_fds)) {
         if (wl_display_read_events(display) < 0) {
             fprintf(stderr, "Failed to read Wayland events\n");
             break;
@@ -522,24 +1656,25 @@ while (1) {
         break;
     }
 
-    if (dbus_dispatch() < 0) {
+    if (FD_ISSET(icon_fd, &read_fds))
+        icon_cache_dispatch();
+
+    if (dbus_dispatch(&read_fds, &write_fds) < 0) {
         fprintf(stderr, "Failed to dispatch D-Bus events\n");
         break;
     }
 
-    unsigned long current_time = time(NULL) * 1000;
-    for (int i = 0; i < notification_count; i++) {
-        Notification *n = &notifications[i];
-        if (!n->configured)
-            continue;
+    sock_dispatch(&read_fds, &write_fds);
+    stats_dispatch(&read_fds);
+    log_dispatch(&write_fds);
 
-        unsigned long display_time = (n->expire_timeout == -1) ? 
-                                  DURATION : n->expire_timeout;
-
-        if (display_time > 0 && 
-            current_time - n->start_time >= display_time) {
-            printf("Removing expired notification %d\n", i);
-            remove_notification(i--);
-        }
-    }
-}}
+    timeout = expire_notifications();
+    timeout = sooner(timeout, flush_burst());
+    timeout = sooner(timeout, dbus_release_replies());
+    timeout = sooner(timeout, dbus_next_timeout());
+}
+    sock_destroy();
+    stats_destroy();
+    log_drain();
+    return 1;
+}
@@ -6,26 +6,87 @@
 #include <pango/pango.h>
 #include "protocols/wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "protocols/xdg-shell-client-protocol.h"
+#include "hints.h"
 #include <stdbool.h> 
 
+/* what happens to a Notify once PENDING_MAX notifications are queued */
+enum {
+    QUEUE_DROP_OLDEST,
+    QUEUE_DROP_NEWEST,
+    QUEUE_COLLAPSE,             /* fold into one "+N more" entry */
+};
+
+/* fields compared to spot a repeated notification, for DEDUP_KEY */
+enum {
+    DEDUP_APP = 1 << 0,
+    DEDUP_SUMMARY = 1 << 1,
+    DEDUP_BODY = 1 << 2,
+};
+
+typedef struct {
+    unsigned long promoted;     /* moved from the queue to the screen */
+    unsigned long expired;      /* timed out before it was ever rendered */
+    unsigned long deduped;      /* repeats folded into a "×N" badge */
+    unsigned long demoted;      /* low urgency sent back to make room */
+    unsigned int depth;
+} QueueStats;
+
+typedef struct {
+    unsigned long partial;      /* damage-limited redraws */
+    unsigned long coalesced;    /* updates superseded before a frame */
+    unsigned long bursts;       /* flush_burst passes that mapped anything */
+    unsigned long batched;      /* surfaces mapped by those passes */
+    unsigned long pooled;       /* shm buffers reused instead of created */
+    unsigned long oversize;     /* string blocks too big for the pool */
+} RenderStats;
+
 typedef struct {
     struct wl_surface *surface;
     struct zwlr_layer_surface_v1 *layer_surface;
     uint32_t width, height;
+    char *strings;              /* one pooled block holding the strings below */
     char *summary;
     char *body;
     char *app_name;
-    int32_t replaces_id;
-    uint32_t expire_timeout;
-    unsigned long start_time;
+    uint32_t id;
+    int32_t expire_timeout;
+    uint8_t urgency;
+    int32_t value;
+    char *category;
+    LazyHint image_data;
+    char *icon_src;             /* image-path or app_icon */
+    int collapsed;              /* > 0: "+N more" stand-in for N dropped */
+    int repeat;                 /* times this content arrived, badge if > 1 */
+    cairo_surface_t *icon;
+    char *icon_key;             /* icon_src while still being decoded */
+    struct wl_buffer *buffer;
+    struct wl_shm_pool *shm_pool;   /* kept to cut buffers of other sizes */
+    void *shm_data;
+    size_t shm_size;
+    cairo_surface_t *target;    /* cairo view of shm_data */
+    bool buffer_busy;           /* held by the compositor */
+    bool redraw_pending;
+    bool icon_dirty;
+    bool badge_dirty;
+    struct wl_callback *frame_cb;
+    bool update_pending;        /* replaced while a frame was in flight */
+    bool resize_pending;        /* new size sent, waiting for configure */
+    int stack_offset;           /* offset last sent as margin, -1 none */
+    unsigned long start_time;   /* monotonic ms */
+    uint64_t received;          /* latency_now() at Notify, 0: untraced */
+    uint8_t traced;             /* LAT_* stages already recorded */
+    unsigned long deadline;     /* monotonic ms, 0 never expires */
     float opacity;
-    cairo_surface_t *cairo_surface;
-    cairo_t *cairo;
     bool configured;
 } Notification;
 
-void add_notification(const char *summary, const char *body,
-                     const char *app_name, uint32_t replaces_id,
-                     uint32_t expire_timeout);
+uint32_t add_notification(const char *summary, const char *body,
+                          const char *app_name, const char *app_icon,
+                          uint32_t replaces_id,
+                          int32_t expire_timeout, const Hints *hints,
+                          uint32_t pid);
+const QueueStats *queue_get_stats(void);
+const RenderStats *render_get_stats(void);
+void icon_loaded(const char *icon, int size, int scale, cairo_surface_t *surface);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE     /* struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sock.h"
+#include "sockproto.h"
+#include "snot.h"
+#include "hints.h"
+#include "latency.h"
+#include "config.h"
+
+/*
+ * Local senders that talk to snot directly instead of through the
+ * session bus. Every packet on a connection is one request and gets one
+ * reply with the ids, so clients can pipeline as deep as the socket
+ * buffers allow. A client whose replies stop fitting is not read from
+ * until it has taken the one that is held for it.
+ */
+static int listen_fd = -1;
+static char sock_path[108];
+static struct {
+    int fd;
+    uint32_t pid;
+    char *held;                 /* reply that did not fit, if any */
+    size_t held_len;
+} clients[SOCKET_CLIENTS];
+static int client_count = 0;
+static SockStats stats;
+
+static int
+set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int
+sock_init(void) {
+    struct sockaddr_un addr;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (!dir) {
+        fprintf(stderr, "XDG_RUNTIME_DIR unset, no local socket\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+                 dir, SOCKET_NAME) >= (int)sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* the bus name is already ours, so a leftover socket is stale */
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(addr.sun_path, 0600) < 0 ||
+        listen(listen_fd, SOCKET_CLIENTS) < 0 ||
+        set_nonblock(listen_fd) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n",
+                addr.sun_path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    memcpy(sock_path, addr.sun_path, sizeof(sock_path));
+    return 0;
+}
+
+void
+sock_destroy(void) {
+    for (int i = 0; i < client_count; i++) {
+        close(clients[i].fd);
+        free(clients[i].held);
+    }
+    client_count = 0;
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(sock_path);
+        listen_fd = -1;
+    }
+}
+
+int
+sock_prepare(fd_set *read_fds, fd_set *write_fds) {
+    int maxfd = listen_fd;
+
+    if (listen_fd < 0)
+        return -1;
+    FD_SET(listen_fd, read_fds);
+    for (int i = 0; i < client_count; i++) {
+        FD_SET(clients[i].fd, clients[i].held ? write_fds : read_fds);
+        maxfd = MAX(maxfd, clients[i].fd);
+    }
+    return maxfd;
+}
+
+static void
+accept_client(void) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd = accept(listen_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+    if (client_count == SOCKET_CLIENTS || set_nonblock(fd) < 0) {
+        close(fd);
+        return;
+    }
+
+    clients[client_count].fd = fd;
+    clients[client_count].pid =
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 ? cred.pid : 0;
+    clients[client_count].held = NULL;
+    client_count++;
+    stats.accepted++;
+}
+
+/* sends a reply, holding on to it if the client's buffer is full */
+static int
+send_reply(int c, const void *reply, size_t len) {
+    if (send(clients[c].fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)len)
+        return 0;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+    if (!(clients[c].held = malloc(len)))
+        return -1;
+    memcpy(clients[c].held, reply, len);
+    clients[c].held_len = len;
+    stats.stalled++;
+    return 0;
+}
+
+/* retries a held reply once the client has made room */
+static int
+flush_held(int c) {
+    if (send(clients[c].fd, clients[c].held, clients[c].held_len,
+             MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    free(clients[c].held);
+    clients[c].held = NULL;
+    return 0;
+}
+
+/* handles one request packet; returns -1 if the client should go */
+static int
+handle_packet(int c, const char *buf, size_t len) {
+    static uint32_t reply[SOCK_PACKET_MAX / sizeof(uint32_t)];
+    static SockNotify records[SOCK_PACKET_MAX / sizeof(SockRecord)];
+    SockHeader hdr;
+    size_t off = sizeof(hdr);
+    uint64_t received = latency_receive();
+
+    if (len < sizeof(hdr))
+        return -1;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != SOCK_MAGIC ||
+        hdr.count > SOCK_PACKET_MAX / sizeof(SockRecord))
+        return -1;
+
+    /* the whole packet is checked first, a bad record must not leave
+     * the ones before it shown with ids the client never learns */
+    for (uint32_t i = 0; i < hdr.count; i++)
+        if (!(off = sock_unpack(buf, len, off, &records[i])))
+            return -1;
+
+    uint32_t *ids = reply + sizeof(hdr) / sizeof(uint32_t);
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        SockNotify *n = &records[i];
+        Hints hints;
+
+        hints_init(&hints);
+        hints.urgency = MIN(n->urgency, URGENCY_CRITICAL);
+        ids[i] = add_notification(n->summary, n->body,
+                                  n->app_name, n->app_icon, n->replaces_id,
+                                  n->expire_timeout, &hints, clients[c].pid);
+    }
+    stats.notifications += hdr.count;
+
+    memcpy(reply, &hdr, sizeof(hdr));
+    if (send_reply(c, reply, sizeof(hdr) + hdr.count * sizeof(uint32_t)) < 0)
+        return -1;
+    latency_record(LAT_REPLY, received);
+    return 0;
+}
+
+/* reads every packet a client has queued, or up to a held reply */
+static int
+read_client(int c) {
+    static char buf[SOCK_PACKET_MAX];
+
+    while (!clients[c].held) {
+        ssize_t n = recv(clients[c].fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        stats.packets++;
+        if ((size_t)n > sizeof(buf) || handle_packet(c, buf, n) < 0) {
+            stats.rejected++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+sock_dispatch(fd_set *read_fds, fd_set *write_fds) {
+    if (listen_fd < 0)
+        return;
+
+    for (int i = 0; i < client_count; i++) {
+        int ret = 0;
+
+        if (clients[i].held && FD_ISSET(clients[i].fd, write_fds) &&
+            (ret = flush_held(i)) == 0 && !clients[i].held)
+            ret = read_client(i);
+        else if (!clients[i].held && FD_ISSET(clients[i].fd, read_fds))
+            ret = read_client(i);
+        if (ret < 0) {
+            close(clients[i].fd);
+            free(clients[i].held);
+            clients[i--] = clients[--client_count];
+        }
+    }
+
+    if (FD_ISSET(listen_fd, read_fds))
+        accept_client();
+}
+
+const SockStats *
+sock_get_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,20 @@
+#ifndef SOCK_H
+#define SOCK_H
+
+#include <sys/select.h>
+
+typedef struct {
+    unsigned long accepted;
+    unsigned long packets;
+    unsigned long notifications;
+    unsigned long rejected;         /* malformed packets */
+    unsigned long stalled;          /* replies held until the client read */
+} SockStats;
+
+int sock_init(void);
+void sock_destroy(void);
+int sock_prepare(fd_set *read_fds, fd_set *write_fds);
+void sock_dispatch(fd_set *read_fds, fd_set *write_fds);
+const SockStats *sock_get_stats(void);
+
+#endif
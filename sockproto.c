@@ -0,0 +1,62 @@
+#include <string.h>
+#include "sockproto.h"
+
+/*
+ * Appends n to the request in buf at off. Returns the offset after it,
+ * or 0 if it does not fit in size bytes.
+ */
+size_t
+sock_pack(char *buf, size_t size, size_t off, const SockNotify *n) {
+    const char *str[4] = { n->app_name, n->app_icon, n->summary, n->body };
+    SockRecord rec;
+    size_t end = off + sizeof(rec);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.replaces_id = n->replaces_id;
+    rec.expire_timeout = n->expire_timeout;
+    rec.urgency = n->urgency;
+    for (int i = 0; i < 4; i++) {
+        size_t l = strlen(str[i] ? str[i] : "") + 1;
+        if (l > UINT16_MAX)
+            return 0;
+        rec.len[i] = l;
+        end += l;
+    }
+    if (end > size)
+        return 0;
+
+    memcpy(buf + off, &rec, sizeof(rec));
+    off += sizeof(rec);
+    for (int i = 0; i < 4; i++) {
+        memcpy(buf + off, str[i] ? str[i] : "", rec.len[i]);
+        off += rec.len[i];
+    }
+    return off;
+}
+
+/*
+ * Reads the record at off. The strings in n point into buf. Returns the
+ * offset after the record, or 0 if it is truncated or malformed.
+ */
+size_t
+sock_unpack(const char *buf, size_t len, size_t off, SockNotify *n) {
+    const char **str[4] = { &n->app_name, &n->app_icon, &n->summary, &n->body };
+    SockRecord rec;
+
+    if (off + sizeof(rec) > len)
+        return 0;
+    memcpy(&rec, buf + off, sizeof(rec));
+    off += sizeof(rec);
+
+    for (int i = 0; i < 4; i++) {
+        if (!rec.len[i] || off + rec.len[i] > len ||
+            buf[off + rec.len[i] - 1] != '\0')
+            return 0;
+        *str[i] = buf + off;
+        off += rec.len[i];
+    }
+    n->replaces_id = rec.replaces_id;
+    n->expire_timeout = rec.expire_timeout;
+    n->urgency = rec.urgency;
+    return off;
+}
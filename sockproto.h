@@ -0,0 +1,47 @@
+#ifndef SOCKPROTO_H
+#define SOCKPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Wire format of the local socket, a SOCK_SEQPACKET socket so one packet
+ * is one request. All integers are in host order, the socket never
+ * leaves the machine.
+ *
+ *   request: SockHeader, then count times SockRecord followed by its four
+ *            strings, each NUL terminated, lengths including the NUL
+ *   reply:   SockHeader, then count uint32_t ids in request order
+ *
+ * Requests may be pipelined; replies come back in the same order.
+ */
+#define SOCK_MAGIC 0x31544e53           /* "SNT1" */
+#define SOCK_PACKET_MAX 65536
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+} SockHeader;
+
+typedef struct {
+    uint32_t replaces_id;
+    int32_t expire_timeout;
+    uint8_t urgency;
+    uint8_t pad;
+    uint16_t len[4];                    /* app_name, app_icon, summary, body */
+} SockRecord;
+
+typedef struct {
+    const char *app_name;
+    const char *app_icon;
+    const char *summary;
+    const char *body;
+    uint32_t replaces_id;
+    int32_t expire_timeout;
+    uint8_t urgency;
+} SockNotify;
+
+size_t sock_pack(char *buf, size_t size, size_t off, const SockNotify *n);
+size_t sock_unpack(const char *buf, size_t len, size_t off, SockNotify *n);
+
+#endif
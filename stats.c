@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "stats.h"
+#include "snot.h"
+#include "dbus.h"
+#include "icon.h"
+#include "sock.h"
+#include "latency.h"
+#include "log.h"
+#include "config.h"
+
+/*
+ * One place that reads every module's stats, for org.snot.Stats.GetStats
+ * and for a plain text dump on $XDG_RUNTIME_DIR/STATS_SOCKET_NAME: each
+ * connection gets "name value" lines and is closed.
+ */
+Counters counters;
+
+static unsigned long window_start;     /* ms the rate was last taken */
+static unsigned long window_wakeups;   /* wakeups then */
+static double wakeup_rate;             /* wakeups per second up to then */
+
+static int listen_fd = -1;
+static char stats_path[108];
+
+void
+stats_wakeup(void) {
+    stat_add(&counters.wakeups, 1);
+}
+
+/* taken when read, so an idle loop shows a falling rate rather than
+ * the one from its last busy second; reads under a second apart share
+ * a rate */
+static double
+wakeups_per_sec(void) {
+    unsigned long now = latency_now_ms();
+    unsigned long wakeups = stat_read(&counters.wakeups);
+
+    if (now - window_start >= 1000) {
+        wakeup_rate = (wakeups - window_wakeups) * 1000.0 / (now - window_start);
+        window_wakeups = wakeups;
+        window_start = now;
+    }
+    return wakeup_rate;
+}
+
+static int
+put(StatEntry *out, int n, int max, const char *name, double value) {
+    if (n < max) {
+        snprintf(out[n].name, sizeof(out[n].name), "%s", name);
+        out[n].value = value;
+    }
+    return n + 1;
+}
+
+static double
+ratio(unsigned long part, unsigned long whole) {
+    return whole ? (double)part / whole : 0;
+}
+
+/* fills out with up to max entries, returns how many there are */
+int
+stats_collect(StatEntry *out, int max) {
+    const QueueStats *q = queue_get_stats();
+    const RenderStats *r = render_get_stats();
+    const IconCacheStats *ic = icon_cache_get_stats();
+    const SockStats *sk = sock_get_stats();
+    const DBusFlushStats *fl = dbus_get_flush_stats();
+    const DBusBatchStats *b = dbus_get_batch_stats();
+    int n = 0;
+
+    n = put(out, n, max, "received", stat_read(&counters.received));
+    n = put(out, n, max, "rendered", stat_read(&counters.rendered));
+    n = put(out, n, max, "rendered_partial", r->partial);
+    n = put(out, n, max, "replaced", stat_read(&counters.replaced));
+    n = put(out, n, max, "coalesced", r->coalesced);
+    n = put(out, n, max, "dropped", stat_read(&counters.dropped));
+    n = put(out, n, max, "rate_limited", stat_read(&counters.rate_limited));
+    n = put(out, n, max, "deduped", q->deduped);
+    n = put(out, n, max, "queued", stat_read(&counters.queued));
+    n = put(out, n, max, "queue_depth", q->depth);
+    n = put(out, n, max, "queue_expired", q->expired);
+    n = put(out, n, max, "shm_bytes", stat_read(&counters.shm_bytes));
+    n = put(out, n, max, "shm_buffers", stat_read(&counters.shm_buffers));
+    n = put(out, n, max, "shm_reused", r->pooled);
+    n = put(out, n, max, "icon_hits", ic->hits);
+    n = put(out, n, max, "icon_misses", ic->misses);
+    n = put(out, n, max, "icon_hit_rate", ratio(ic->hits, ic->hits + ic->misses));
+    n = put(out, n, max, "icon_bytes", ic->bytes);
+    n = put(out, n, max, "wakeups", stat_read(&counters.wakeups));
+    n = put(out, n, max, "wakeups_per_sec", wakeups_per_sec());
+    n = put(out, n, max, "dbus_sent", fl->messages);
+    n = put(out, n, max, "dbus_batched", b->notifications);
+    n = put(out, n, max, "socket_received", sk->notifications);
+    n = put(out, n, max, "socket_stalled", sk->stalled);
+    n = put(out, n, max, "log_dropped", log_dropped());
+
+    for (int i = 0; i < LAT_COUNT; i++) {
+        const char *stage = latency_stage_name(i);
+        LatencySummary s;
+        char name[32];
+
+        latency_summary(i, &s);
+        snprintf(name, sizeof(name), "%s_count", stage);
+        n = put(out, n, max, name, s.count);
+        snprintf(name, sizeof(name), "%s_p50_us", stage);
+        n = put(out, n, max, name, s.p50);
+        snprintf(name, sizeof(name), "%s_p90_us", stage);
+        n = put(out, n, max, name, s.p90);
+        snprintf(name, sizeof(name), "%s_p99_us", stage);
+        n = put(out, n, max, name, s.p99);
+        snprintf(name, sizeof(name), "%s_max_us", stage);
+        n = put(out, n, max, name, s.max);
+    }
+    return n;
+}
+
+int
+stats_init(void) {
+    struct sockaddr_un addr;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    window_start = latency_now_ms();
+    if (!dir)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+                 dir, STATS_SOCKET_NAME) >= (int)sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path too long\n");
+        return -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(addr.sun_path, 0600) < 0 ||
+        listen(listen_fd, 4) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n",
+                addr.sun_path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    memcpy(stats_path, addr.sun_path, sizeof(stats_path));
+    return 0;
+}
+
+void
+stats_destroy(void) {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(stats_path);
+        listen_fd = -1;
+    }
+}
+
+int
+stats_prepare(fd_set *read_fds) {
+    if (listen_fd >= 0)
+        FD_SET(listen_fd, read_fds);
+    return listen_fd;
+}
+
+/* the dump fits the socket buffer, so a reader that is slow to read
+ * never holds up the main loop */
+void
+stats_dispatch(fd_set *read_fds) {
+    static StatEntry entries[STATS_MAX];
+    static char buf[8192];
+    size_t len = 0;
+    int fd, count;
+
+    if (listen_fd < 0 || !FD_ISSET(listen_fd, read_fds))
+        return;
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+        return;
+
+    count = MIN(stats_collect(entries, STATS_MAX), STATS_MAX);
+    for (int i = 0; i < count && len < sizeof(buf); i++)
+        len += snprintf(buf + len, sizeof(buf) - len, "%s %.17g\n",
+                        entries[i].name, entries[i].value);
+    send(fd, buf, MIN(len, sizeof(buf) - 1), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
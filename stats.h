@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <sys/select.h>
+
+/*
+ * The counters scraped for fleet health, bumped on the hot path. Each
+ * sits on its own cache line and is updated with a relaxed atomic add,
+ * so no writer ever takes a lock or shares a line with another. A reader
+ * gets every counter exactly, but not all from the same instant. The
+ * finer breakdowns stay in each module's own stats struct.
+ */
+typedef struct {
+    unsigned long value;
+} __attribute__((aligned(64))) StatCounter;
+
+typedef struct {
+    StatCounter received;           /* notifications from any transport */
+    StatCounter rendered;           /* full redraws committed */
+    StatCounter replaced;           /* replaces_id updates received */
+    StatCounter dropped;            /* lost to a full pending queue */
+    StatCounter rate_limited;       /* folded into an "N more" entry */
+    StatCounter queued;             /* entered the pending queue */
+    StatCounter wakeups;            /* main loop passes */
+    StatCounter shm_bytes;          /* gauge: shm mapped, in use or pooled */
+    StatCounter shm_buffers;        /* gauge */
+} Counters;
+
+extern Counters counters;
+
+static inline void
+stat_add(StatCounter *c, long n) {
+    __atomic_fetch_add(&c->value, (unsigned long)n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long
+stat_read(const StatCounter *c) {
+    return __atomic_load_n(&c->value, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+    char name[32];
+    double value;
+} StatEntry;
+
+#define STATS_MAX 96
+
+int stats_collect(StatEntry *out, int max);
+void stats_wakeup(void);
+int stats_init(void);
+void stats_destroy(void);
+int stats_prepare(fd_set *read_fds);
+void stats_dispatch(fd_set *read_fds);
+
+#endif